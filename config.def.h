@@ -5,11 +5,47 @@ static char *useragent      = "Mozilla/5.0 (X11; U; Unix; en-US) "
 static char *scriptfile     = "~/.surf/script.js";
 static char *styledir       = "~/.surf/styles/";
 static char *cachefolder    = "~/.surf/cache/";
+static char *assetdir       = "~/.surf/assets/"; /* see -A */
+static char *downloaddir    = "~/Downloads/";
+static char *archivedir     = "~/.surf/archives/";
+static int downloadsegments = 4;     /* Parallel requests for downloads */
+static goffset segmentthreshold = 8 * 1024 * 1024; /* of at least this */
+static guint downloadretries = 5;    /* Retries of a failed request */
 
 static Bool kioskmode       = FALSE; /* Ignore shortcuts */
+static Bool playlistmode    = FALSE; /* Rotate through playlist[] in
+                                      * kiosk mode */
 static Bool showindicators  = TRUE;  /* Show indicators in window title */
 static Bool zoomto96dpi     = TRUE;  /* Zoom pages to always emulate 96dpi */
 static Bool runinfullscreen = FALSE; /* Run in fullscreen mode by default */
+static Bool restoresession  = FALSE; /* Save and reopen windows */
+static Bool enablestats     = FALSE; /* Log timings and counters to stderr */
+static Bool throttlehidden  = TRUE;  /* Slow down timers and pause
+                                      * animations of hidden windows */
+static guint gcinterval     = 60;    /* Seconds between JavaScript garbage
+                                      * collections of hidden or idle
+                                      * windows, 0 disables them */
+static guint triminterval   = 300;   /* Seconds between returning freed
+                                      * memory to the system, which is
+                                      * also done after loads and closing
+                                      * windows; 0 disables it */
+static Bool enablepagecache = FALSE; /* Keep left pages for back/forward */
+static guint pagecachepages = 3;     /* Pages a window keeps cached */
+static gsize pagecachebytes = 32 * 1024 * 1024; /* and their size */
+static guint memorybudget   = 0;     /* KiB all surf processes together
+                                      * may use, 0 means no limit */
+static guint budgetinterval = 5;     /* Seconds between checks of it */
+static guint pressureinterval = 2;   /* Seconds between memory pressure
+                                      * checks, 0 disables them */
+/*
+ * Percentages of time stalled on memory at which surf shrinks the memory
+ * cache, drops it, collects JavaScript garbage, drops the page cache and
+ * suspends hidden windows.
+ */
+static double pressurestages[] = { 5.0, 10.0, 20.0, 30.0, 40.0 };
+static guint suspendtimeout = 0;     /* Seconds a window may stay
+                                      * unmapped before its page is
+                                      * unloaded, 0 means never */
 
 static guint defaultfontsize = 12;   /* Default font size */
 static gfloat zoomlevel = 1.0;       /* Default zoom level */
@@ -18,21 +54,39 @@ static gfloat zoomlevel = 1.0;       /* Default zoom level */
 static char *cookiefile     = "~/.surf/cookies.txt";
 static char *cookiepolicies = "Aa@"; /* A: accept all; a: accept nothing,
                                       * @: accept no third party */
+static char *instancefile   = "~/.surf/instances";
+static char *sessiondir     = "~/.surf/session/"; /* see -R */
+static char *historyfile    = "~/.surf/history"; /* see -H */
+static int historymatches   = 1000;
 static char *cafile         = "/etc/ssl/certs/ca-certificates.crt";
 static Bool strictssl       = FALSE; /* Refuse untrusted SSL connections */
 static time_t sessiontime   = 3600;
+static Bool enablescheduler = TRUE;  /* Hold back third party images and
+                                      * trackers until the render blocking
+                                      * requests are done */
 
 /* Webkit default features */
 static Bool enablescrollbars      = TRUE;
 static Bool enablespatialbrowsing = TRUE;
 static Bool enablediskcache       = TRUE;
 static int diskcachebytes         = 5 * 1024 * 1024;
+static guint prewarmjobs          = 4;     /* Pages -w loads at once */
+static guint prewarmtimeout       = 60;    /* Seconds -w waits for one */
 static Bool enableplugins         = TRUE;
+static Bool clicktoplay           = TRUE;  /* Start plugins on click only */
+static char *pluginsallowed       = NULL;  /* Regexp of page URIs whose
+                                            * plugins start right away */
 static Bool enablescripts         = TRUE;
 static Bool enableinspector       = TRUE;
 static Bool enablestyle           = TRUE;
 static Bool loadimages            = TRUE;
+static Bool lazyimages            = FALSE; /* Load images and frames of
+                                            * the page only when they
+                                            * come near the viewport */
+static gdouble lazymargin         = 1.0;   /* in viewport heights */
 static Bool hidebackground        = FALSE;
+static Bool highlightsource       = TRUE;  /* Color tags in page sources */
+static Bool findhighlight         = TRUE;  /* Highlight all find matches */
 static Bool allowgeolocation      = TRUE;
 
 #define SETPROP(p, q) { \
@@ -45,13 +99,31 @@ static Bool allowgeolocation      = TRUE;
 	} \
 }
 
-/* DOWNLOAD(URI, referer) */
-#define DOWNLOAD(d, r) { \
+/* SETURI(readprop, setprop), offering the history as well */
+#define SETURI(p, q) { \
 	.v = (char *[]){ "/bin/sh", "-c", \
-	     "st -e /bin/sh -c \"curl -L -J -O --user-agent '$1'" \
-	     " --referer '$2' -b $3 -c $3 '$0';" \
-	     " sleep 5;\"", \
-	     d, useragent, r, cookiefile, NULL \
+	     "prop=\"`(xprop -id $2 $0 " \
+	     "| sed \"s/^$0(STRING) = \\(\\\\\"\\?\\)\\(.*\\)\\1$/\\2/\" " \
+	     "| xargs -0 printf %b; surf -H '') | dmenu -l 10`\" &&" \
+	     "xprop -id $2 -f $1 8s -set $1 \"$prop\"", \
+	     p, q, winid, NULL \
+	} \
+}
+
+/*
+ * Page URIs matching this regexp are handed to PLAY() when loaded, e.g.
+ * "^https?://(www\\.)?(youtube\\.com/watch|vimeo\\.com/[0-9])".
+ */
+static char *videosites = NULL;
+/* Videos opened directly, not embedded in a page, are handed to PLAY(). */
+static Bool playdirectvideos = FALSE;
+
+/* PLAY(URI, referer) */
+#define PLAY(u, r) { \
+	.v = (char *[]){ "/bin/sh", "-c", \
+	     "mpv --really-quiet --user-agent=\"$1\" --referrer=\"$2\"" \
+	     " --cookies --cookies-file=\"$3\" -- \"$0\"", \
+	     u, useragent, r, cookiefile, NULL \
 	} \
 }
 
@@ -75,6 +147,55 @@ static SiteStyle styles[] = {
 	{ ".*",                 "default.css" },
 };
 
+/* site settings */
+/*
+ * Applied to the WebKitWebSettings when the main frame navigates to a host
+ * ending in the given suffix, without reloading. Only the rules of the
+ * longest matching suffix apply, all others are undone.
+ */
+static SiteSetting sitesettings[] = {
+	/* host suffix          setting                     value */
+	{ "ads.example.com",    "enable-scripts",           FALSE },
+	{ "ads.example.com",    "auto-load-images",         FALSE },
+	{ "example.com",        "enable-plugins",           FALSE },
+};
+
+/* resource budgets */
+/*
+ * The iteration will stop at the first match, beginning at the beginning of
+ * the list. Once a budget of a page is used up, further requests are cut
+ * and logged to stderr. Bytes per type are counted and cut by the
+ * Content-Type of the responses. 0 means unlimited.
+ */
+static SiteBudget budgets[] = {
+	/* regexp       total bytes  requests  bytes per type */
+	{ "^https?://(www\\.)?example\\.com/",
+	                8 << 20,     200,      { [ResScript] = 2 << 20,
+	                                         [ResMedia]  = 1 } },
+};
+
+/*
+ * cache policies, used with enablediskcache
+ * Pages matching the regexp and all their resources are shown from the disk
+ * cache when the cached copy is at most maxstale seconds past its expiry,
+ * and revalidated in the background once the page has loaded. When the
+ * network is down any cached copy is used.
+ */
+static CachePolicy cachepolicies[] = {
+	/* regexp                                     maxstale */
+	{ "^https?://dashboard\\.example\\.com/",     24 * 60 * 60 },
+};
+
+/*
+ * playlist, shown in turn with playlistmode in kiosk mode
+ * Each page is loaded in the background while the one before is shown.
+ */
+static PlaylistEntry playlist[] = {
+	/* uri                                        seconds */
+	{ "https://dashboard.example.com/sales",     60 },
+	{ "https://dashboard.example.com/support",   30 },
+};
+
 #define MODKEY GDK_CONTROL_MASK
 
 /* hotkeys */
@@ -110,9 +231,11 @@ static Key keys[] = {
 	{ 0,                    GDK_F11,    fullscreen, { 0 } },
 	{ 0,                    GDK_Escape, stop,       { 0 } },
 	{ MODKEY,               GDK_o,      source,     { 0 } },
+	{ MODKEY,               GDK_e,      archive,    { 0 } },
+	{ MODKEY,               GDK_w,      playvideo,  { 0 } },
 	{ MODKEY|GDK_SHIFT_MASK,GDK_o,      inspector,  { 0 } },
 
-	{ MODKEY,               GDK_g,      spawn,      SETPROP("_SURF_URI", "_SURF_GO") },
+	{ MODKEY,               GDK_g,      spawn,      SETURI("_SURF_URI", "_SURF_GO") },
 	{ MODKEY,               GDK_f,      spawn,      SETPROP("_SURF_FIND", "_SURF_FIND") },
 	{ MODKEY,               GDK_slash,  spawn,      SETPROP("_SURF_FIND", "_SURF_FIND") },
 
@@ -136,6 +259,7 @@ static Button buttons[] = {
 	{ ClkLink,      0,          2,      linkopenembed,  { 0 } },
 	{ ClkLink,      MODKEY,     2,      linkopen,       { 0 } },
 	{ ClkLink,      MODKEY,     1,      linkopen,       { 0 } },
+	{ ClkMedia,     MODKEY,     1,      playvideo,      { 0 } },
 	{ ClkAny,       0,          8,      navigate,       { .i = -1 } },
 	{ ClkAny,       0,          9,      navigate,       { .i = +1 } },
 };
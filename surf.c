@@ -25,17 +25,40 @@
 #include <regex.h>
 #include <pwd.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "arg.h"
 
 char *argv0;
 
 #define LENGTH(x)               (sizeof(x) / sizeof(x[0]))
+#define MAXINSTANCES            256
+#define HISTORYFOLD             (64 * 1024)
+#define HISTORYREFOLD           (60 * 60)
+#define MAXSEGMENTS             16
+#define REVALIDATEAFTER         60
 #define CLEANMASK(mask)         (mask & (MODKEY|GDK_SHIFT_MASK))
 #define COOKIEJAR_TYPE          (cookiejar_get_type ())
 #define COOKIEJAR(obj)          (G_TYPE_CHECK_INSTANCE_CAST ((obj), COOKIEJAR_TYPE, CookieJar))
+#define ASSETREQUEST_TYPE       (assetrequest_get_type ())
 
-enum { AtomFind, AtomGo, AtomUri, AtomLast };
+enum { AtomFind, AtomGo, AtomUri, AtomHeap, AtomLast };
+enum {
+	ResDoc,
+	ResStyle,
+	ResScript,
+	ResFont,
+	ResImage,
+	ResMedia,
+	ResOther,
+	ResLast,
+};
 enum {
 	ClkDoc   = WEBKIT_HIT_TEST_RESULT_CONTEXT_DOCUMENT,
 	ClkLink  = WEBKIT_HIT_TEST_RESULT_CONTEXT_LINK,
@@ -53,6 +76,21 @@ union Arg {
 	const void *v;
 };
 
+typedef struct {
+	char **uris, **titles;
+	int n, current;
+	gdouble x, y;
+	gfloat zoom;
+} PageState;
+
+/* Slot of a surf process in instancefile. */
+typedef struct {
+	pid_t pid;
+	long rss;
+	guint windows, visible;
+	gint64 lastactive;
+} Instance;
+
 typedef struct Client {
 	GtkWidget *win, *scroll, *vbox, *pane;
 	WebKitWebView *view;
@@ -60,10 +98,69 @@ typedef struct Client {
 	char *title, *linkhover;
 	const char *needle;
 	gint progress;
+	gint64 loadstart;
+	GHashTable *lazy, *lazytops;
+	guint lazydeferred, lazyreleased, lazyindexed, imgcount;
+	gsize imgbytes;
+	struct SiteBudget *budget;
+	guint requests, cut;
+	gsize bytes, typebytes[ResLast];
+	GSList *overrides;
+	GHashTable *plugins;
 	struct Client *next;
-	gboolean zoomed, fullscreen, isinspecting, sslfailed;
+	gboolean zoomed, fullscreen, isinspecting, sslfailed, playing;
+	gboolean visible, suspended, pending, restoring;
+	gint64 lastactive, since, cpu;
+	guint suspendtimer;
+	GdkPixmap *snapshot;
+	GtkWidget *placeholder;
+	PageState state;
+	gboolean restorescroll;
+	gint64 lastgc, navstart;
+	GSList *downloads, *transfers, *frames;
+	gboolean issource, offline, retried, cacheonly;
+	GHashTable *archive;
+	guint archiveid;
+	struct CachePolicy *cachepolicy;
+	char *findneedle, *findtext;
+	GArray *findhits;
+	guint findcur;
+	gboolean findstale;
+	GHashTable *stale;
+	guint cachedpages;
+	gsize cachedbytes;
+	WebKitWebView *preload;
+	GtkWidget *preloadwin;
+	GSList *preloadoverrides;
+	struct CachePolicy *preloadpolicy;
+	guint playtimer, playpos;
 } Client;
 
+/* Range of a segmented download, fetched with its own request. */
+typedef struct {
+	SoupMessage *msg;
+	goffset start, pos, end;
+	guint retries, retry;
+	struct Transfer *t;
+} Segment;
+
+typedef struct Transfer {
+	char *uri, *referer, *etag, *path, *part, *state;
+	goffset total;
+	int fd, nseg, active;
+	gboolean stopped;
+	gint64 started, saved;
+	Segment seg[MAXSEGMENTS];
+	Client *c;
+} Transfer;
+
+/* Page source being rendered for a view-source window. */
+typedef struct {
+	Client *c;
+	char *uri, *encoding;
+	GString *data, *html;
+} Source;
+
 typedef struct {
 	guint mod;
 	guint keyval;
@@ -90,12 +187,69 @@ typedef struct {
 
 G_DEFINE_TYPE(CookieJar, cookiejar, SOUP_TYPE_COOKIE_JAR_TEXT)
 
+typedef struct {
+	SoupRequest parent_instance;
+} AssetRequest;
+
+typedef struct {
+	SoupRequestClass parent_class;
+} AssetRequestClass;
+
+G_DEFINE_TYPE(AssetRequest, assetrequest, SOUP_TYPE_REQUEST)
+
+typedef struct {
+	char *file;
+	char *type;
+	GMappedFile *map;
+	gsize offset, length;
+} Asset;
+
 typedef struct {
 	char *regex;
 	char *style;
 	regex_t re;
 } SiteStyle;
 
+typedef struct {
+	char *host;
+	char *setting;
+	Bool value;
+} SiteSetting;
+
+typedef struct SiteBudget {
+	char *regex;
+	gsize bytes;
+	guint requests;
+	gsize typebytes[ResLast];
+	regex_t re;
+} SiteBudget;
+
+typedef struct {
+	WebKitWebView *view;
+	GtkWidget *win;
+	char *uri;
+	gint64 start;
+	guint timer;
+	int requests, hits;
+	const char *result;
+} Warm;
+
+typedef struct {
+	char *uri;
+	guint seconds;
+} PlaylistEntry;
+
+typedef struct CachePolicy {
+	char *regex;
+	guint maxstale;
+	regex_t re;
+} CachePolicy;
+
+/* Validators of a cached response, for asking whether it is current. */
+typedef struct {
+	char *etag, *modified;
+} Validators;
+
 static Display *dpy;
 static Atom atoms[AtomLast];
 static Client *clients = NULL;
@@ -109,16 +263,148 @@ static GTlsDatabase *tlsdb;
 static int policysel = 0;
 static char *stylefile = NULL;
 static SoupCache *diskcache = NULL;
+/* Timers of a frame are wrapped only while its window is hidden. */
+static const char *throttlescript =
+	"(function() {"
+	"if (window.__surfthrottle)"
+	"	return;"
+	"var hidden = false, frames = [], style = null, orig = {}, wrap;"
+	"['setTimeout', 'setInterval', 'requestAnimationFrame',"
+	" 'webkitRequestAnimationFrame'].forEach(function(k) {"
+	"	if (window[k])"
+	"		orig[k] = window[k];"
+	"});"
+	"var raf = orig.requestAnimationFrame"
+	"	|| orig.webkitRequestAnimationFrame;"
+	"function frame(f) {"
+	"	if (!hidden)"
+	"		return raf.call(window, f);"
+	"	frames.push(f);"
+	"	return 0;"
+	"}"
+	"wrap = {"
+	"	setTimeout: function(f, t) {"
+	"		var a = Array.prototype.slice.call(arguments);"
+	"		if (hidden)"
+	"			a[1] = Math.max(t | 0, 1000);"
+	"		return orig.setTimeout.apply(window, a);"
+	"	},"
+	"	setInterval: function(f, t) {"
+	"		var a = Array.prototype.slice.call(arguments, 2), last = 0;"
+	"		return orig.setInterval.call(window, function() {"
+	"			var now = Date.now();"
+	"			if (hidden && now - last < 1000)"
+	"				return;"
+	"			last = now;"
+	"			typeof f == 'function' ? f.apply(window, a)"
+	"			                       : (0, eval)(f);"
+	"		}, t);"
+	"	},"
+	"	requestAnimationFrame: frame,"
+	"	webkitRequestAnimationFrame: frame"
+	"};"
+	"function swap(from, to) {"
+	"	for (var k in orig)"
+	"		if (window[k] === from[k])"
+	"			window[k] = to[k];"
+	"}"
+	"window.__surfthrottle = function(h) {"
+	"	if (h == hidden)"
+	"		return;"
+	"	hidden = h;"
+	"	if (h) {"
+	"		swap(orig, wrap);"
+	"		if (document.documentElement) {"
+	"			style = document.createElement('style');"
+	"			style.textContent = '* { -webkit-animation-play-state:"
+	"				paused !important; }';"
+	"			document.documentElement.appendChild(style);"
+	"		}"
+	"	} else {"
+	"		swap(wrap, orig);"
+	"		if (style && style.parentNode)"
+	"			style.parentNode.removeChild(style);"
+	"		style = null;"
+	"		while (frames.length)"
+	"			raf.call(window, frames.shift());"
+	"	}"
+	"};"
+	"})();";
+static const char *findscript =
+	"(function() {"
+	"var o = window.MutationObserver || window.WebKitMutationObserver;"
+	"if (!o || window.__surffindstale !== undefined)"
+	"	return;"
+	"window.__surffindstale = true;"
+	"new o(function() {"
+	"	window.__surffindstale = true;"
+	"}).observe(document, { childList: true, characterData: true,"
+	"                       subtree: true });"
+	"})();";
+static const char *findcheck =
+	"(function() {"
+	"var s = window.__surffindstale !== false;"
+	"if (window.__surffindstale !== undefined)"
+	"	window.__surffindstale = false;"
+	"return s;"
+	"})()";
+static GHashTable *assets = NULL;
+static GHashTable *assetschemes = NULL;
+static guint archives = 0;
+static GSList *deferred = NULL;
+static int critical = 0;
+static GHashTable *sitehosts = NULL;
+static regex_t pluginre;
+static regex_t videore;
+static guint pluginsavoided = 0;
+static guint suspends = 0, resumes = 0;
+static char *pressurefile = NULL;
+static char *sessionfile = NULL;
+static char *historyindex = NULL, *historyprefix = NULL;
+static GThread *historyfolder = NULL;
+static GString *historypending = NULL;
+static GHashTable *revalidated = NULL;
+static char *prewarmfile = NULL;
+static char **warmuris = NULL;
+static guint warmnext = 0, warmjobs = 0;
+static int warmfailed = 0;
+static int historyfd = -1;
+static gint64 starttime;
+static int instancefd = -1;
+static Instance *instances = NULL, *instance = NULL;
+static int pressurestage = 0;
 
 static void addaccelgroup(Client *c);
+static void applysitesettings(Client *c, WebKitWebView *v, const char *uri);
+
+/* Local asset store */
+static void archive(Client *c, const Arg *arg);
+static void assetfree(gpointer d);
+static const char *assetkey(const char *key, guint *id);
+static Asset *findasset(const char *key);
+static Asset *getasset(SoupURI *uri);
+static void importassets(const char *pattern);
+static void loadassets(void);
+static GInputStream *assetrequest_send(SoupRequest *r, GCancellable *cancel,
+                                       GError **error);
+static goffset assetrequest_get_content_length(SoupRequest *r);
+static const char *assetrequest_get_content_type(SoupRequest *r);
+
 static void beforerequest(WebKitWebView *w, WebKitWebFrame *f,
                           WebKitWebResource *r, WebKitNetworkRequest *req,
                           WebKitNetworkResponse *resp, Client *c);
+static const char *budgetexceeded(Client *c, int class);
 static char *buildfile(const char *path);
 static char *buildpath(const char *path);
 static gboolean buttonrelease(WebKitWebView *web, GdkEventButton *e, Client *c);
+static int classify(WebKitWebFrame *f, const char *uri);
 static void cleanup(void);
+static gboolean coordinate(gpointer d);
+static int coordinateorder(const void *a, const void *b);
+static void contentreceived(WebKitWebView *v, WebKitWebFrame *f,
+                            WebKitWebResource *r, gint len, Client *c);
 static void clipboard(Client *c, const Arg *arg);
+static void collectgarbage(Client *c, const char *why);
 
 /* Cookiejar implementation */
 static void cookiejar_changed(SoupCookieJar *self, SoupCookie *old_cookie,
@@ -132,11 +418,18 @@ static void cookiejar_set_property(GObject *self, guint prop_id,
 static char cookiepolicy_set(const SoupCookieJarAcceptPolicy p);
 
 static char *copystr(char **str, const char *src);
+static gint64 cputime(void);
+static GtkWidget *createplugin(WebKitWebView *v, gchar *mime, gchar *uri,
+                               GHashTable *param, Client *c);
 static WebKitWebView *createwindow(WebKitWebView *v, WebKitWebFrame *f,
                                    Client *c);
 static gboolean decidedownload(WebKitWebView *v, WebKitWebFrame *f,
                                WebKitNetworkRequest *r, gchar *m,
 			       WebKitWebPolicyDecision *p, Client *c);
+static gboolean decidenavigation(WebKitWebView *v, WebKitWebFrame *f,
+                                 WebKitNetworkRequest *r,
+                                 WebKitWebNavigationAction *n,
+                                 WebKitWebPolicyDecision *p, Client *c);
 static gboolean decidewindow(WebKitWebView *v, WebKitWebFrame *f,
                              WebKitNetworkRequest *r, WebKitWebNavigationAction
 			     *n, WebKitWebPolicyDecision *p, Client *c);
@@ -145,20 +438,50 @@ static gboolean deletion_interface(WebKitWebView *view,
 static void destroyclient(Client *c);
 static void destroywin(GtkWidget* w, Client *c);
 static void die(const char *errstr, ...);
+static void downloadstatus(WebKitDownload *o, GParamSpec *pspec, Client *c);
+static void droppagecache(Client *c);
 static void eval(Client *c, const Arg *arg);
+static void evalframes(Client *c, const char *script);
+static void evalscript(JSContextRef js, char *script, char *scriptname);
 static void find(Client *c, const Arg *arg);
+static gboolean findchanged(Client *c);
+static void findindex(Client *c, const char *needle);
+static void findreset(Client *c);
+static void framegone(gpointer d, GObject *frame);
+static void freestate(PageState *s);
+static void freevalidators(gpointer d);
 static void fullscreen(Client *c, const Arg *arg);
 static void geopolicyrequested(WebKitWebView *v, WebKitWebFrame *f,
                                WebKitGeolocationPolicyDecision *d, Client *c);
 static const char *getatom(Client *c, int a);
 static void gettogglestat(Client *c);
 static void getpagestat(Client *c);
+static long getrss(void);
+static gboolean gcidle(gpointer d);
 static char *geturi(Client *c);
+static void joininstances(void);
+static SiteBudget *getbudget(const char *uri);
+static CachePolicy *getcachepolicy(const char *uri);
 static const gchar *getstyle(const char *uri);
 static void setstyle(Client *c, const char *style);
 
 static void handleplumb(Client *c, WebKitWebView *w, const gchar *uri);
-
+static void historyadd(const char *uri);
+static void historybuild(void);
+static int historycmp(const void *a, const void *b);
+static gsize historyfirst(const char *p, gsize len, const char *key);
+static void historyflush(gboolean wait);
+static gpointer historyfold(gpointer d);
+static gboolean historyjoin(gpointer d);
+static const char *historykey(const char *uri);
+static int historykeycmp(const void *a, const void *b);
+static int historymatch(const char *uri, gsize len, const char *pattern);
+static void historyquery(const char *pattern);
+static int historyrankcmp(const void *a, const void *b);
+static void historyrefold(void);
+static gboolean historytimer(gpointer d);
+
+static gboolean incache(const char *uri);
 static gboolean initdownload(WebKitWebView *v, WebKitDownload *o, Client *c);
 
 static void inspector(Client *c, const Arg *arg);
@@ -168,37 +491,111 @@ static gboolean inspector_show(WebKitWebInspector *i, Client *c);
 static gboolean inspector_close(WebKitWebInspector *i, Client *c);
 static void inspector_finished(WebKitWebInspector *i, Client *c);
 
+static char *jsquote(const char *s);
 static gboolean keypress(GtkAccelGroup *group, GObject *obj, guint key,
                          GdkModifierType mods, Client *c);
+static gboolean lazybelow(Client *c, const char *uri);
+static gdouble lazybottom(Client *c);
+static void lazyindex(Client *c);
+static glong lazytop(WebKitDOMElement *e);
+static void lazyrelease(Client *c);
+static void lazyreport(Client *c);
+static void lazyscroll(GtkAdjustment *a, Client *c);
 static void linkhover(WebKitWebView *v, const char* t, const char* l,
                       Client *c);
+static void loadstatus(Client *c, WebKitLoadStatus status);
 static void loadstatuschange(WebKitWebView *view, GParamSpec *pspec,
                              Client *c);
+static char *loadarchive(Client *c, const char *path);
+static gboolean loaderror(WebKitWebView *v, WebKitWebFrame *f, gchar *uri,
+                          GError *err, Client *c);
 static void loaduri(Client *c, const Arg *arg);
+static int loadsession(void);
+static int mimeclass(const char *mime, const char *uri);
 static void navigate(Client *c, const Arg *arg);
 static Client *newclient(void);
+static WebKitWebView *newview(Client *c);
 static void newwindow(Client *c, const Arg *arg, gboolean noembed);
 static void pasteuri(GtkClipboard *clipboard, const char *text, gpointer d);
+static void playlisthold(WebKitWebView *v, Client *c, gboolean hold);
+static gboolean playlistnext(gpointer d);
+static void playlistpreload(Client *c);
+static void playliststart(Client *c);
+static void playplugin(GtkButton *b, Client *c);
+static void playvideo(Client *c, const Arg *arg);
 static gboolean contextmenu(WebKitWebView *view, GtkWidget *menu,
                             WebKitHitTestResult *target, gboolean keyboard,
 			    Client *c);
 static void menuactivate(GtkMenuItem *item, Client *c);
+static gboolean pressurepoll(gpointer d);
+static int prewarm(const char *manifest);
+static gboolean prewarmdone(gpointer d);
+static gboolean prewarmexpire(gpointer d);
+static gboolean prewarmload(gpointer d);
+static void prewarmrequest(WebKitWebView *v, WebKitWebFrame *f,
+                           WebKitWebResource *r, WebKitNetworkRequest *req,
+                           WebKitNetworkResponse *resp, Warm *w);
+static void prewarmstatus(WebKitWebView *v, GParamSpec *pspec, Warm *w);
 static void print(Client *c, const Arg *arg);
+static void releasedeferred(void);
+static int resourceclass(WebKitWebResource *r);
+static void requestqueued(SoupSession *s, SoupMessage *msg, gpointer d);
+static void requestunqueued(SoupSession *s, SoupMessage *msg, gpointer d);
 static GdkFilterReturn processx(GdkXEvent *xevent, GdkEvent *event,
                                 gpointer d);
 static void progresschange(WebKitWebView *view, GParamSpec *pspec, Client *c);
+static void resourcefinished(WebKitWebView *v, WebKitWebFrame *f,
+                             WebKitWebResource *r, Client *c);
+static void responsereceived(WebKitWebView *v, WebKitWebFrame *f,
+                             WebKitWebResource *r,
+                             WebKitNetworkResponse *resp, Client *c);
 static void linkopen(Client *c, const Arg *arg);
 static void linkopenembed(Client *c, const Arg *arg);
+static void refresh(Client *c);
 static void reload(Client *c, const Arg *arg);
+static void restorenext(void);
+static void restorepending(Client *c);
+static void restorestate(Client *c, PageState *s);
+static void resumeclient(Client *c);
+static void revalidate(Client *c);
+static gboolean revalidatedold(gpointer k, gpointer v, gpointer d);
+static void savesession(void);
+static gboolean samesite(const char *a, const char *b);
+static void savestate(Client *c, PageState *s);
 static void scroll_h(Client *c, const Arg *arg);
 static void scroll_v(Client *c, const Arg *arg);
 static void scroll(GtkAdjustment *a, const Arg *arg);
 static void setatom(Client *c, int a, const char *v);
+static void segmentchunk(SoupMessage *msg, SoupBuffer *chunk, Segment *s);
+static void segmentdone(SoupSession *session, SoupMessage *msg, gpointer d);
+static gboolean segmentfetch(Segment *s);
+static void segmentheaders(SoupMessage *msg, Segment *s);
+static gboolean segmentretry(gpointer d);
+static gboolean servedstale(SoupMessage *msg);
 static void setup(void);
+static void setvisible(Client *c, gboolean visible);
+static void shedmemory(int stage);
 static void sigchld(int unused);
 static void source(Client *c, const Arg *arg);
+static gpointer sourcehighlight(gpointer d);
+static gboolean sourceshow(gpointer d);
 static void spawn(Client *c, const Arg *arg);
+static void stats(Client *c, const char *fmt, ...);
+static void stopmedia(Client *c);
+static gboolean suspendclient(gpointer d);
+static void takesnapshot(Client *c);
+static gboolean trimmemory(gpointer d);
+static gboolean trimtimer(gpointer d);
 static void stop(Client *c, const Arg *arg);
+static void transferfail(Transfer *t, const char *why, gboolean discard);
+static void transferfinish(Transfer *t);
+static void transferfree(Transfer *t);
+static Transfer *transfernew(Client *c, const char *path);
+static char *transferpath(const char *name);
+static void transferresume(Client *c);
+static void transfersave(Transfer *t);
+static void transferstart(Transfer *t);
+static void transferstop(Transfer *t);
 static void titlechange(WebKitWebView *view, GParamSpec *pspec, Client *c);
 static void titlechangeleave(void *a, void *b, Client *c);
 static void toggle(Client *c, const Arg *arg);
@@ -209,6 +606,7 @@ static void togglestyle(Client *c, const Arg *arg);
 static void updatetitle(Client *c);
 static void updatewinid(Client *c);
 static void usage(void);
+static gboolean winevent(GtkWidget *w, GdkEvent *e, Client *c);
 static void windowobjectcleared(GtkWidget *w, WebKitWebFrame *frame,
                                 JSContextRef js, JSObjectRef win, Client *c);
 static void zoom(Client *c, const Arg *arg);
@@ -231,14 +629,388 @@ addaccelgroup(Client *c)
 	gtk_window_add_accel_group(GTK_WINDOW(c->win), group);
 }
 
+void
+applysitesettings(Client *c, WebKitWebView *v, const char *uri)
+{
+	WebKitWebSettings *settings = webkit_web_view_get_settings(v);
+	GSList **overrides = v == c->preload ? &c->preloadoverrides
+	                     : &c->overrides;
+	SiteSetting *o, *r;
+	GSList *l, *rules = NULL;
+	SoupURI *u;
+	const char *h;
+	gboolean value;
+	struct timespec t0, t1;
+
+	/* undo the previous site's settings, last applied first */
+	for (l = *overrides; l; l = l->next) {
+		o = l->data;
+		g_object_set(G_OBJECT(settings), o->setting, o->value, NULL);
+		g_free(o);
+	}
+	g_slist_free(*overrides);
+	*overrides = NULL;
+
+	if (!(u = soup_uri_new(uri)))
+		return;
+
+	/* the longest matching host suffix wins */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (h = soup_uri_get_host(u); h; h = (h = strchr(h, '.')) ? h + 1
+	     : NULL) {
+		if ((rules = g_hash_table_lookup(sitehosts, h)))
+			break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stats(c, "site settings: lookup took %ld ns",
+	      (t1.tv_sec - t0.tv_sec) * 1000000000L + t1.tv_nsec - t0.tv_nsec);
+
+	for (l = rules; l; l = l->next) {
+		r = l->data;
+		g_object_get(G_OBJECT(settings), r->setting, &value, NULL);
+		o = g_new(SiteSetting, 1);
+		o->setting = r->setting;
+		o->value = value;
+		*overrides = g_slist_prepend(*overrides, o);
+		g_object_set(G_OBJECT(settings), r->setting, r->value, NULL);
+	}
+	soup_uri_free(u);
+}
+
+/*
+ * Writes the page and the subresources WebKit holds for it into a single
+ * file in archivedir, which loaduri() serves from the asset store. The file
+ * is written aside and renamed over the old one, which other processes may
+ * still have mapped.
+ */
+void
+archive(Client *c, const Arg *arg)
+{
+	WebKitWebDataSource *src;
+	WebKitWebResource *r;
+	GList *resources, *l;
+	GString *head, *data;
+	const char *uri, *key, *type;
+	char *name, *path, *tmp;
+	gsize offset = 0;
+	gint64 start = g_get_monotonic_time();
+	gboolean ok;
+	FILE *f = NULL;
+	int fd, n = 0;
+
+	src = webkit_web_frame_get_data_source(
+	      webkit_web_view_get_main_frame(c->view));
+	if (webkit_web_data_source_is_loading(src)
+	    || !(r = webkit_web_data_source_get_main_resource(src)))
+		return;
+
+	resources = g_list_prepend(
+	            webkit_web_data_source_get_subresources(src), r);
+	head = g_string_new(NULL);
+	g_string_append_printf(head, "SURFARCHIVE 1\t%s\n", geturi(c));
+	for (l = resources; l; l = l->next) {
+		uri = webkit_web_resource_get_uri(l->data);
+		data = webkit_web_resource_get_data(l->data);
+		if (!data || !(key = strstr(uri, "://")))
+			continue;
+		if (!(type = webkit_web_resource_get_mime_type(l->data)))
+			type = "application/octet-stream";
+		g_string_append_printf(head, "%s\t%s\t%lu\t%lu\n", key + 3,
+		    type, (unsigned long)offset, (unsigned long)data->len);
+		offset += data->len;
+		n++;
+	}
+	g_string_append_c(head, '\n');
+
+	name = g_compute_checksum_for_string(G_CHECKSUM_SHA256, geturi(c), -1);
+	path = g_strdup_printf("%s/%s.surfarchive", archivedir, name);
+	tmp = g_strdup_printf("%s.XXXXXX", path);
+	if ((ok = (fd = g_mkstemp(tmp)) >= 0 && (f = fdopen(fd, "w")))) {
+		ok = fwrite(head->str, 1, head->len, f) == head->len;
+		for (l = resources; ok && l; l = l->next) {
+			uri = webkit_web_resource_get_uri(l->data);
+			data = webkit_web_resource_get_data(l->data);
+			if (data && strstr(uri, "://"))
+				ok = fwrite(data->str, 1, data->len, f)
+				     == data->len;
+		}
+	} else if (fd >= 0) {
+		close(fd);
+	}
+	if (f && fclose(f))
+		ok = FALSE;
+	if (ok && !rename(tmp, path)) {
+		fprintf(stderr, "surf: archived %s to %s\n", geturi(c), path);
+	} else {
+		fprintf(stderr, "surf: cannot write %s: %s\n", path,
+		        strerror(errno));
+		if (fd >= 0)
+			unlink(tmp);
+	}
+	stats(c, "archived %d resources, %lu bytes in %ld ms", n,
+	      (unsigned long)offset,
+	      (long)(g_get_monotonic_time() - start) / 1000);
+
+	g_free(name);
+	g_free(path);
+	g_free(tmp);
+	g_string_free(head, TRUE);
+	g_list_free(resources);
+}
+
+void
+assetfree(gpointer d)
+{
+	Asset *a = (Asset *)d;
+
+	if (a->map)
+		g_mapped_file_unref(a->map);
+	g_free(a->file);
+	g_free(a->type);
+	g_free(a);
+}
+
+/*
+ * Splits the archive of a window off an asset key. Its entries are served
+ * as surfasset://<id>.surfarchive.<host>/<path>, so relative references
+ * stay in the archive and no other window sees them.
+ */
+const char *
+assetkey(const char *key, guint *id)
+{
+	char *p;
+	guint n = strtoul(key, &p, 10);
+
+	if (p == key || !g_str_has_prefix(p, ".surfarchive.")) {
+		if (id)
+			*id = 0;
+		return key;
+	}
+	if (id)
+		*id = n;
+	return p + strlen(".surfarchive.");
+}
+
+void
+assetrequest_class_init(AssetRequestClass *klass)
+{
+	static const char *schemes[] = { "surfasset", NULL };
+
+	SOUP_REQUEST_CLASS(klass)->schemes = schemes;
+	SOUP_REQUEST_CLASS(klass)->send = assetrequest_send;
+	SOUP_REQUEST_CLASS(klass)->get_content_length =
+	    assetrequest_get_content_length;
+	SOUP_REQUEST_CLASS(klass)->get_content_type =
+	    assetrequest_get_content_type;
+}
+
+void
+assetrequest_init(AssetRequest *self)
+{
+}
+
+GInputStream *
+assetrequest_send(SoupRequest *r, GCancellable *cancel, GError **error)
+{
+	Asset *a;
+	GBytes *map, *body;
+	GInputStream *s;
+
+	if (!(a = getasset(soup_request_get_uri(r)))) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+		            "Asset not in store");
+		return NULL;
+	}
+
+	/*
+	 * Nothing is copied, the stream holds the mapping even when the
+	 * window of an archive goes away.
+	 */
+	map = g_mapped_file_get_bytes(a->map);
+	body = g_bytes_new_from_bytes(map, a->offset, a->length);
+	s = g_memory_input_stream_new_from_bytes(body);
+	g_bytes_unref(body);
+	g_bytes_unref(map);
+
+	return s;
+}
+
+goffset
+assetrequest_get_content_length(SoupRequest *r)
+{
+	Asset *a = getasset(soup_request_get_uri(r));
+
+	return a ? a->length : -1;
+}
+
+const char *
+assetrequest_get_content_type(SoupRequest *r)
+{
+	Asset *a = getasset(soup_request_get_uri(r));
+
+	return a ? a->type : "application/octet-stream";
+}
+
 void
 beforerequest(WebKitWebView *w, WebKitWebFrame *f, WebKitWebResource *r,
               WebKitNetworkRequest *req, WebKitNetworkResponse *resp,
 	      Client *c)
 {
 	const gchar *uri = webkit_network_request_get_uri(req);
+	const gchar *key, *reason, *scheme, *page;
+	struct CachePolicy **policy;
+	gboolean shown = w == c->view;
+	SoupMessage *msg;
+	char *u, *host;
 	int i, isascii = 1;
 
+	/*
+	 * Assets are keyed by the URI without its scheme, so relative
+	 * references inside a stored stylesheet resolve to surfasset:// too.
+	 * Those which are not in the store go back to the network, with the
+	 * scheme assets of their host were last requested with. The archive
+	 * of a window comes before the store.
+	 */
+	if (assets && (key = strstr(uri, "://"))) {
+		key += 3;
+		if (g_str_has_prefix(uri, "surfasset://")) {
+			if (!findasset(key)) {
+				key = assetkey(key, NULL);
+				host = g_strndup(key, strcspn(key, "/"));
+				if (!(scheme = g_hash_table_lookup(
+				    assetschemes, host)))
+					scheme = "https";
+				u = g_strconcat(scheme, "://", key, NULL);
+				webkit_network_request_set_uri(req, u);
+				g_free(u);
+				g_free(host);
+			}
+			return;
+		}
+		if (!g_str_has_prefix(uri, "http://")
+		    && !g_str_has_prefix(uri, "https://"))
+			u = NULL;
+		else if (c->archive && g_hash_table_lookup(c->archive, key))
+			u = g_strdup_printf("surfasset://%u.surfarchive.%s",
+			                    c->archiveid, key);
+		else if (g_hash_table_lookup(assets, key))
+			u = g_strconcat("surfasset://", key, NULL);
+		else
+			u = NULL;
+		if (u) {
+			g_hash_table_replace(assetschemes,
+			                     g_strndup(key, strcspn(key, "/")),
+			                     g_str_has_prefix(uri, "https://")
+			                     ? "https" : "http");
+			webkit_network_request_set_uri(req, u);
+			g_free(u);
+			return;
+		}
+	}
+
+	/*
+	 * Images of <img> elements and documents of <iframe> elements of the
+	 * page below the viewport are held back until lazyrelease() finds
+	 * them near it and loads them again. Other images, like those of
+	 * stylesheets, scripts or subframes, could not be restored and are
+	 * left alone.
+	 */
+	if (lazyimages && w == c->view
+	    && webkit_web_view_get_load_status(w) != WEBKIT_LOAD_PROVISIONAL
+	    && (g_str_has_prefix(uri, "http://")
+	    || g_str_has_prefix(uri, "https://"))
+	    && ((f == webkit_web_view_get_main_frame(w)
+	    && classify(f, uri) == ResImage)
+	    || (webkit_web_frame_get_parent(f)
+	    == webkit_web_view_get_main_frame(w)
+	    && classify(f, uri) == ResDoc))
+	    && !g_hash_table_lookup(c->lazy, uri) && lazybelow(c, uri)) {
+		g_hash_table_insert(c->lazy, g_strdup(uri),
+		                    GINT_TO_POINTER(1));
+		c->lazydeferred++;
+		webkit_network_request_set_uri(req, "about:blank");
+		return;
+	}
+
+	/*
+	 * The class guessed from the URI cuts requests early, the one of the
+	 * response, which the bytes are counted by, is checked again by
+	 * responsereceived(). The budget is that of the page shown.
+	 */
+	if (shown && c->budget && (g_str_has_prefix(uri, "http://")
+	    || g_str_has_prefix(uri, "https://"))
+	    && ((i = classify(f, uri)) != ResDoc
+	    || f != webkit_web_view_get_main_frame(w))) {
+		if (c->budget->requests && c->requests >= c->budget->requests)
+			reason = "requests";
+		else
+			reason = budgetexceeded(c, i);
+		if (reason) {
+			fprintf(stderr, "surf: budget: cut %s (%s)\n", uri,
+			        reason);
+			c->cut++;
+			webkit_network_request_set_uri(req, "about:blank");
+			return;
+		}
+		c->requests++;
+	}
+
+	/*
+	 * Cached copies are used without asking the network when the site's
+	 * cache policy allows them to be that stale, and in any case while
+	 * the network is down. A reload already asks for fresh copies with
+	 * its own Cache-Control, which is left alone, unless it only applies
+	 * a setting and must not go to the network at all. A view preloading
+	 * a playlist entry has a policy of its own.
+	 */
+	if (diskcache && (g_str_has_prefix(uri, "http://")
+	    || g_str_has_prefix(uri, "https://"))) {
+		policy = shown ? &c->cachepolicy : &c->preloadpolicy;
+		if (f == webkit_web_view_get_main_frame(w)
+		    && classify(f, uri) == ResDoc)
+			*policy = getcachepolicy(uri);
+		msg = webkit_network_request_get_message(req);
+		if (shown && c->cacheonly) {
+			soup_message_headers_remove(msg->request_headers,
+			                            "If-None-Match");
+			soup_message_headers_remove(msg->request_headers,
+			                            "If-Modified-Since");
+			u = g_strdup("max-stale");
+		} else if (soup_message_headers_get_one(msg->request_headers,
+		           "Cache-Control")) {
+			u = NULL;
+		} else if ((shown && c->offline)
+		           || !g_network_monitor_get_network_available(
+		           g_network_monitor_get_default())) {
+			u = g_strdup("max-stale");
+		} else if (*policy) {
+			u = g_strdup_printf("max-stale=%u", (*policy)->maxstale);
+		} else {
+			u = NULL;
+		}
+		if (u) {
+			soup_message_headers_replace(msg->request_headers,
+			                            "Cache-Control", u);
+			g_free(u);
+		}
+	}
+
+	/*
+	 * WebKit copies the headers, but not the message, into the request it
+	 * queues, so the class travels to requestqueued() as a header.
+	 */
+	if (enablescheduler && (g_str_has_prefix(uri, "http://")
+	    || g_str_has_prefix(uri, "https://"))) {
+		msg = webkit_network_request_get_message(req);
+		if (!(page = webkit_web_view_get_uri(w)))
+			page = "about:blank";
+		u = g_strdup_printf("%d%s", classify(f, uri),
+		                    samesite(uri, page) ? "" : "t");
+		soup_message_headers_replace(msg->request_headers,
+		                             "X-Surf-Class", u);
+		g_free(u);
+	}
+
 	if (g_str_has_suffix(uri, "/favicon.ico"))
 		webkit_network_request_set_uri(req, "about:blank");
 
@@ -248,6 +1020,7 @@ beforerequest(WebKitWebView *w, WebKitWebFrame *f, WebKitWebResource *r,
 	    && !g_str_has_prefix(uri, "file://")
 	    && !g_str_has_prefix(uri, "data:")
 	    && !g_str_has_prefix(uri, "blob:")
+	    && !g_str_has_prefix(uri, "surfasset://")
 	    && strlen(uri) > 0) {
 		for (i = 0; i < strlen(uri); i++) {
 			if (!g_ascii_isprint(uri[i])) {
@@ -260,6 +1033,31 @@ beforerequest(WebKitWebView *w, WebKitWebFrame *f, WebKitWebResource *r,
 	}
 }
 
+/* Returns the name of the first budget of c's page used up by now. */
+const char *
+budgetexceeded(Client *c, int class)
+{
+	static const char *names[ResLast] = {
+		[ResDoc]    = "document bytes",
+		[ResStyle]  = "stylesheet bytes",
+		[ResScript] = "script bytes",
+		[ResFont]   = "font bytes",
+		[ResImage]  = "image bytes",
+		[ResMedia]  = "media bytes",
+		[ResOther]  = "other bytes",
+	};
+	SiteBudget *b = c->budget;
+
+	if (!b)
+		return NULL;
+	if (b->bytes && c->bytes >= b->bytes)
+		return "total bytes";
+	if (b->typebytes[class] && c->typebytes[class] >= b->typebytes[class])
+		return names[class];
+
+	return NULL;
+}
+
 char *
 buildfile(const char *path)
 {
@@ -322,28 +1120,92 @@ buildpath(const char *path)
 	return fpath;
 }
 
+int
+classify(WebKitWebFrame *f, const char *uri)
+{
+	static const struct {
+		const char *suffix;
+		int class;
+	} suffixes[] = {
+		{ ".css",   ResStyle },
+		{ ".js",    ResScript },
+		{ ".woff",  ResFont },
+		{ ".woff2", ResFont },
+		{ ".ttf",   ResFont },
+		{ ".otf",   ResFont },
+		{ ".eot",   ResFont },
+		{ ".png",   ResImage },
+		{ ".jpg",   ResImage },
+		{ ".jpeg",  ResImage },
+		{ ".gif",   ResImage },
+		{ ".webp",  ResImage },
+		{ ".svg",   ResImage },
+		{ ".ico",   ResImage },
+		{ ".mp4",   ResMedia },
+		{ ".webm",  ResMedia },
+		{ ".ogg",   ResMedia },
+		{ ".ogv",   ResMedia },
+		{ ".mp3",   ResMedia },
+		{ ".swf",   ResMedia },
+	};
+	WebKitWebDataSource *src;
+	WebKitNetworkRequest *req;
+	const char *p;
+	char *path;
+	int i, class = ResOther;
+
+	if (f && (src = webkit_web_frame_get_provisional_data_source(f))
+	    && (req = webkit_web_data_source_get_request(src))
+	    && !g_strcmp0(webkit_network_request_get_uri(req), uri))
+		return ResDoc;
+
+	p = strstr(uri, "://");
+	p = p ? p + 3 : uri;
+	path = g_ascii_strdown(p, strcspn(p, "?#"));
+	for (i = 0; i < LENGTH(suffixes); i++) {
+		if (g_str_has_suffix(path, suffixes[i].suffix)) {
+			class = suffixes[i].class;
+			break;
+		}
+	}
+	g_free(path);
+
+	return class;
+}
+
 gboolean
 buttonrelease(WebKitWebView *web, GdkEventButton *e, Client *c)
 {
 	WebKitHitTestResultContext context;
 	WebKitHitTestResult *result;
-	Arg arg;
+	Arg arg, media;
 	unsigned int i;
+	gboolean handled = false;
 
 	result = webkit_web_view_get_hit_test_result(web, e);
 	g_object_get(result, "context", &context, NULL);
 	g_object_get(result, "link-uri", &arg.v, NULL);
+	g_object_get(result, "media-uri", &media.v, NULL);
 	for (i = 0; i < LENGTH(buttons); i++) {
 		if (context & buttons[i].click
 		    && e->button == buttons[i].button
 		    && CLEANMASK(e->state) == CLEANMASK(buttons[i].mask)
 		    && buttons[i].func) {
-			buttons[i].func(c, buttons[i].click == ClkLink
-			    && buttons[i].arg.i == 0 ? &arg : &buttons[i].arg);
-			return true;
+			if (buttons[i].arg.i != 0)
+				buttons[i].func(c, &buttons[i].arg);
+			else if (buttons[i].click == ClkLink)
+				buttons[i].func(c, &arg);
+			else if (buttons[i].click == ClkMedia)
+				buttons[i].func(c, &media);
+			else
+				buttons[i].func(c, &buttons[i].arg);
+			handled = true;
+			break;
 		}
 	}
-	return false;
+	g_free((char *)media.v);
+
+	return handled;
 }
 
 void
@@ -355,11 +1217,110 @@ cleanup(void)
 	}
 	while (clients)
 		destroyclient(clients);
+	if (sessionfile)
+		g_remove(sessionfile);
+	if (historyfolder) {
+		g_thread_join(historyfolder);
+		historyfolder = NULL;
+	}
+	historyflush(TRUE);
+	if (historyfd >= 0 && lseek(historyfd, 0, SEEK_END) > HISTORYFOLD)
+		historyfold(NULL);
+	if (instance) {
+		flock(instancefd, LOCK_EX);
+		instance->pid = 0;
+		flock(instancefd, LOCK_UN);
+	}
 	g_free(cookiefile);
 	g_free(scriptfile);
 	g_free(stylefile);
 }
 
+/*
+ * Publishes the memory use of this process in instancefile and, when all
+ * surf processes together use more than memorybudget, asks the hidden and
+ * least recently used ones above their share of it to shed memory.
+ */
+gboolean
+coordinate(gpointer d)
+{
+	Instance live[MAXINSTANCES];
+	Client *c;
+	long total = 0, share, excess;
+	int i, n = 0;
+	gboolean shed = FALSE;
+
+	flock(instancefd, LOCK_EX);
+	instance->rss = getrss();
+	instance->windows = instance->visible = 0;
+	instance->lastactive = 0;
+	for (c = clients; c; c = c->next) {
+		instance->windows++;
+		instance->visible += c->visible;
+		instance->lastactive = MAX(instance->lastactive,
+		                           c->lastactive);
+	}
+
+	for (i = 0; i < MAXINSTANCES; i++) {
+		if (!instances[i].pid)
+			continue;
+		if (kill(instances[i].pid, 0) == -1 && errno == ESRCH) {
+			instances[i].pid = 0;
+			continue;
+		}
+		live[n++] = instances[i];
+		total += instances[i].rss;
+	}
+	flock(instancefd, LOCK_UN);
+
+	if (total <= (long)memorybudget)
+		return TRUE;
+
+	share = memorybudget / n;
+	excess = total - memorybudget;
+	qsort(live, n, sizeof(live[0]), coordinateorder);
+	for (i = 0; i < n && excess > 0; i++) {
+		if (live[i].rss <= share)
+			continue;
+		if (live[i].pid == instance->pid) {
+			shed = TRUE;
+			break;
+		}
+		excess -= live[i].rss - share;
+	}
+	if (!shed)
+		return TRUE;
+
+	stats(NULL, "%ld of %ld KiB budget used by %d processes, "
+	      "shedding %ld KiB over share", total, (long)memorybudget, n,
+	      instance->rss - share);
+	shedmemory(3);
+	trimmemory("budget");
+	if (getrss() > share)
+		shedmemory(5);
+
+	return TRUE;
+}
+
+/* Orders hidden before visible processes, then least recently used first. */
+int
+coordinateorder(const void *a, const void *b)
+{
+	const Instance *x = a, *y = b;
+
+	if (!x->visible != !y->visible)
+		return x->visible ? 1 : -1;
+	return (x->lastactive > y->lastactive) - (x->lastactive < y->lastactive);
+}
+
+void
+contentreceived(WebKitWebView *v, WebKitWebFrame *f, WebKitWebResource *r,
+                gint len, Client *c)
+{
+	c->bytes += len;
+	c->typebytes[resourceclass(r)] += len;
+}
+
 void
 cookiejar_changed(SoupCookieJar *self, SoupCookie *old_cookie,
                   SoupCookie *new_cookie)
@@ -451,6 +1412,19 @@ cookiepolicy_set(const SoupCookieJarAcceptPolicy ep)
 	return 'A';
 }
 
+/* Runs script in every frame of the page of c which has a window object. */
+void
+evalframes(Client *c, const char *script)
+{
+	GSList *l;
+
+	for (l = c->frames; l; l = l->next) {
+		if (webkit_web_frame_get_web_view(l->data) == c->view)
+			evalscript(webkit_web_frame_get_global_context(
+			           l->data), (char *)script, "");
+	}
+}
+
 void
 evalscript(JSContextRef js, char *script, char* scriptname)
 {
@@ -493,6 +1467,47 @@ clipboard(Client *c, const Arg *arg)
 	}
 }
 
+/*
+ * Runs the JavaScript garbage collector and publishes the heap statistics
+ * of c in its _SURF_HEAP property.
+ */
+void
+collectgarbage(Client *c, const char *why)
+{
+	JSContextRef js;
+	JSStringRef jsscript;
+	JSValueRef v;
+	long rss = getrss();
+	double nodes = 0, globals = 0;
+	char *heap;
+
+	if (c->suspended)
+		return;
+
+	js = webkit_web_frame_get_global_context(
+	     webkit_web_view_get_main_frame(c->view));
+	JSGarbageCollect(js);
+	c->lastgc = g_get_monotonic_time();
+
+	jsscript = JSStringCreateWithUTF8CString(
+	           "document.getElementsByTagName('*').length");
+	if ((v = JSEvaluateScript(js, jsscript, NULL, NULL, 0, NULL)))
+		nodes = JSValueToNumber(js, v, NULL);
+	JSStringRelease(jsscript);
+	jsscript = JSStringCreateWithUTF8CString("Object.keys(window).length");
+	if ((v = JSEvaluateScript(js, jsscript, NULL, NULL, 0, NULL)))
+		globals = JSValueToNumber(js, v, NULL);
+	JSStringRelease(jsscript);
+
+	heap = g_strdup_printf("nodes=%.0f globals=%.0f rss=%ld", nodes,
+	                       globals, getrss());
+	setatom(c, AtomHeap, heap);
+	g_free(heap);
+
+	stats(c, "js gc (%s): %.0f nodes, %.0f globals, rss %ld -> %ld KiB",
+	      why, nodes, globals, rss, getrss());
+}
+
 char *
 copystr(char **str, const char *src)
 {
@@ -506,6 +1521,42 @@ copystr(char **str, const char *src)
 	return tmp;
 }
 
+/* Returns the CPU time used by the process in microseconds. */
+gint64
+cputime(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+	return t.tv_sec * G_USEC_PER_SEC + t.tv_nsec / 1000;
+}
+
+/* Stands in for plugins until they are clicked, see playplugin(). */
+GtkWidget *
+createplugin(WebKitWebView *v, gchar *mime, gchar *uri, GHashTable *param,
+             Client *c)
+{
+	GtkWidget *w;
+	char *label;
+
+	if (!clicktoplay || g_hash_table_lookup(c->plugins, uri ? uri : "")
+	    || (pluginsallowed && !regexec(&pluginre, geturi(c), 0, NULL, 0)))
+		return NULL;
+
+	label = g_strdup_printf("Click to play %s", mime ? mime : "plugin");
+	w = gtk_button_new_with_label(label);
+	g_free(label);
+	g_object_set_data_full(G_OBJECT(w), "uri", g_strdup(uri ? uri : ""),
+	                       g_free);
+	g_signal_connect(G_OBJECT(w), "clicked", G_CALLBACK(playplugin), c);
+	gtk_widget_show(w);
+
+	pluginsavoided++;
+	stats(c, "plugins: %u instantiations avoided", pluginsavoided);
+
+	return w;
+}
+
 WebKitWebView *
 createwindow(WebKitWebView  *v, WebKitWebFrame *f, Client *c)
 {
@@ -517,6 +1568,29 @@ gboolean
 decidedownload(WebKitWebView *v, WebKitWebFrame *f, WebKitNetworkRequest *r,
                gchar *m,  WebKitWebPolicyDecision *p, Client *c)
 {
+	const char *reason;
+	int class;
+	Arg a;
+
+	/* a video opened directly plays in the external player */
+	if (playdirectvideos && v == c->view && f == webkit_web_view_get_main_frame(v)
+	    && g_str_has_prefix(m, "video/")) {
+		webkit_web_policy_decision_ignore(p);
+		a.v = webkit_network_request_get_uri(r);
+		playvideo(c, &a);
+		return TRUE;
+	}
+
+	class = mimeclass(m, webkit_network_request_get_uri(r));
+	if (v == c->view && f != webkit_web_view_get_main_frame(v)
+	    && (reason = budgetexceeded(c, class))) {
+		fprintf(stderr, "surf: budget: cut %s (%s)\n",
+		        webkit_network_request_get_uri(r), reason);
+		c->cut++;
+		webkit_web_policy_decision_ignore(p);
+		return TRUE;
+	}
+
 	if (!webkit_web_view_can_show_mime_type(v, m)) {
 		webkit_web_policy_decision_download(p);
 		return TRUE;
@@ -524,6 +1598,16 @@ decidedownload(WebKitWebView *v, WebKitWebFrame *f, WebKitNetworkRequest *r,
 	return FALSE;
 }
 
+gboolean
+decidenavigation(WebKitWebView *v, WebKitWebFrame *f, WebKitNetworkRequest *r,
+                 WebKitWebNavigationAction *n, WebKitWebPolicyDecision *p,
+                 Client *c)
+{
+	if (f == webkit_web_view_get_main_frame(v))
+		applysitesettings(c, v, webkit_network_request_get_uri(r));
+	return FALSE;
+}
+
 gboolean
 decidewindow(WebKitWebView *view, WebKitWebFrame *f, WebKitNetworkRequest *r,
              WebKitWebNavigationAction *n, WebKitWebPolicyDecision *p,
@@ -550,10 +1634,27 @@ deletion_interface(WebKitWebView *view, WebKitDOMHTMLElement *arg1, Client *c)
 void
 destroyclient(Client *c)
 {
-	Client *p;
-
+	Client *p, *heir = clients != c ? clients : c->next;
+	Transfer *t;
+	GSList *l;
+
+	g_slist_foreach(c->downloads, (GFunc)webkit_download_cancel, NULL);
+	/* segmented downloads carry on in another window, if any */
+	for (l = c->transfers; l; l = l->next) {
+		t = l->data;
+		if ((t->c = heir))
+			heir->transfers = g_slist_prepend(heir->transfers, t);
+		else
+			transferstop(t);
+	}
+	g_slist_free(c->transfers);
 	webkit_web_view_stop_loading(c->view);
 	gtk_widget_destroy(GTK_WIDGET(c->view));
+	for (l = c->frames; l; l = l->next)
+		g_object_weak_unref(G_OBJECT(l->data), framegone, c);
+	g_slist_free(c->frames);
+	if (c->archive)
+		g_hash_table_destroy(c->archive);
 	gtk_widget_destroy(c->scroll);
 	gtk_widget_destroy(c->vbox);
 	gtk_widget_destroy(c->win);
@@ -564,9 +1665,30 @@ destroyclient(Client *c)
 		p->next = c->next;
 	else
 		clients = c->next;
+	g_hash_table_destroy(c->lazy);
+	g_hash_table_destroy(c->lazytops);
+	g_hash_table_destroy(c->stale);
+	g_hash_table_destroy(c->plugins);
+	findreset(c);
+	g_array_free(c->findhits, TRUE);
+	if (c->suspendtimer)
+		g_source_remove(c->suspendtimer);
+	if (c->playtimer)
+		g_source_remove(c->playtimer);
+	if (c->preloadwin)
+		gtk_widget_destroy(c->preloadwin);
+	if (c->snapshot)
+		g_object_unref(c->snapshot);
+	freestate(&c->state);
+	g_slist_free_full(c->overrides, g_free);
+	g_slist_free_full(c->preloadoverrides, g_free);
 	free(c);
 	if (clients == NULL)
 		gtk_main_quit();
+	else if (triminterval)
+		g_idle_add(trimmemory, "close");
+	if (clients)
+		savesession();
 }
 
 void
@@ -575,6 +1697,50 @@ destroywin(GtkWidget* w, Client *c)
 	destroyclient(c);
 }
 
+/* Evicts the pages of c from the back/forward cache. */
+void
+droppagecache(Client *c)
+{
+	WebKitWebSettings *settings = webkit_web_view_get_settings(c->view);
+	gboolean on;
+
+	g_object_get(G_OBJECT(settings), "enable-page-cache", &on, NULL);
+	if (on) {
+		g_object_set(G_OBJECT(settings), "enable-page-cache", FALSE,
+		             NULL);
+		g_object_set(G_OBJECT(settings), "enable-page-cache", TRUE,
+		             NULL);
+	}
+	c->cachedpages = c->cachedbytes = 0;
+}
+
+void
+downloadstatus(WebKitDownload *o, GParamSpec *pspec, Client *c)
+{
+	switch (webkit_download_get_status(o)) {
+	case WEBKIT_DOWNLOAD_STATUS_FINISHED:
+		fprintf(stderr, "surf: downloaded %s\n",
+		        webkit_download_get_destination_uri(o));
+		break;
+	case WEBKIT_DOWNLOAD_STATUS_ERROR:
+	case WEBKIT_DOWNLOAD_STATUS_CANCELLED:
+		fprintf(stderr, "surf: download of %s failed\n",
+		        webkit_download_get_uri(o));
+		break;
+	default:
+		updatetitle(c);
+		return;
+	}
+
+	stats(c, "download of %lu bytes after %.1f s",
+	      (unsigned long)webkit_download_get_current_size(o),
+	      webkit_download_get_elapsed_time(o));
+	g_signal_handlers_disconnect_by_data(o, c);
+	c->downloads = g_slist_remove(c->downloads, o);
+	g_object_unref(o);
+	updatetitle(c);
+}
+
 void
 die(const char *errstr, ...)
 {
@@ -586,17 +1752,177 @@ die(const char *errstr, ...)
 	exit(EXIT_FAILURE);
 }
 
+/* Looks key up in the archive of the window it names, or in the store. */
+Asset *
+findasset(const char *key)
+{
+	Client *c;
+	guint id;
+
+	key = assetkey(key, &id);
+	if (!id)
+		return g_hash_table_lookup(assets, key);
+	for (c = clients; c && c->archiveid != id; c = c->next)
+		;
+
+	return c && c->archive ? g_hash_table_lookup(c->archive, key) : NULL;
+}
+
 void
 find(Client *c, const Arg *arg)
 {
 	const char *s;
+	char *needle;
+	guint n;
 
 	s = getatom(c, AtomFind);
 	gboolean forward = *(gboolean *)arg;
 	webkit_web_view_search_text(c->view, s, FALSE, forward, TRUE);
+
+	needle = g_utf8_casefold(s, -1);
+	if (c->findneedle && !strcmp(needle, c->findneedle)) {
+		if ((n = c->findhits->len))
+			c->findcur = (c->findcur + (forward ? 1 : n - 1)) % n;
+	} else {
+		findindex(c, needle);
+		c->findcur = 0;
+		if (findhighlight) {
+			webkit_web_view_unmark_text_matches(c->view);
+			webkit_web_view_mark_text_matches(c->view, s, FALSE, 0);
+			webkit_web_view_set_highlight_text_matches(c->view, TRUE);
+		}
+	}
+	g_free(needle);
+	updatetitle(c);
 }
 
-void
+/*
+ * Tells whether the document of any frame of c was mutated since the last
+ * call, as seen by the observer of findscript. Frames without one count as
+ * changed.
+ */
+gboolean
+findchanged(Client *c)
+{
+	JSContextRef js;
+	JSStringRef jsscript;
+	JSValueRef v;
+	gboolean changed = FALSE;
+	GSList *l;
+
+	jsscript = JSStringCreateWithUTF8CString(findcheck);
+	for (l = c->frames; l; l = l->next) {
+		if (webkit_web_frame_get_web_view(l->data) != c->view)
+			continue;
+		js = webkit_web_frame_get_global_context(l->data);
+		if (!(v = JSEvaluateScript(js, jsscript, NULL, NULL, 0, NULL))
+		    || JSValueToBoolean(js, v))
+			changed = TRUE;
+	}
+	JSStringRelease(jsscript);
+
+	return changed;
+}
+
+/*
+ * Finds the offsets of needle in the text of the page, taken from the body
+ * of every frame. The text is kept until a frame loads or a document is
+ * mutated, and a needle extending the previous one only narrows down its
+ * matches. Matches may overlap, so that narrowing keeps every one a fresh
+ * scan would find.
+ */
+void
+findindex(Client *c, const char *needle)
+{
+	WebKitDOMDocument *doc;
+	WebKitDOMHTMLElement *body;
+	gboolean narrow = FALSE;
+	gsize len = strlen(needle), off;
+	GString *all;
+	GSList *l;
+	char *text, *p;
+	guint i, j;
+
+	if (findchanged(c) || c->findstale || !c->findtext) {
+		all = g_string_new(NULL);
+		for (l = c->frames; l; l = l->next) {
+			if (webkit_web_frame_get_web_view(l->data) != c->view
+			    || !(doc = webkit_web_frame_get_dom_document(
+			    l->data)) || !(body = webkit_dom_document_get_body(
+			    doc)))
+				continue;
+			text = webkit_dom_html_element_get_inner_text(body);
+			g_string_append(all, text);
+			g_string_append_c(all, '\n');
+			g_free(text);
+		}
+		g_free(c->findtext);
+		c->findtext = g_utf8_casefold(all->str, all->len);
+		g_string_free(all, TRUE);
+		c->findstale = FALSE;
+	} else if (c->findneedle && *c->findneedle) {
+		narrow = g_str_has_prefix(needle, c->findneedle);
+	}
+
+	if (narrow) {
+		for (i = j = 0; i < c->findhits->len; i++) {
+			off = g_array_index(c->findhits, gsize, i);
+			if (!strncmp(c->findtext + off, needle, len))
+				g_array_index(c->findhits, gsize, j++) = off;
+		}
+		g_array_set_size(c->findhits, j);
+	} else {
+		g_array_set_size(c->findhits, 0);
+		for (p = c->findtext; len && (p = strstr(p, needle)); p++) {
+			off = p - c->findtext;
+			g_array_append_val(c->findhits, off);
+		}
+	}
+	g_free(c->findneedle);
+	c->findneedle = g_strdup(needle);
+
+	stats(c, "find: %u matches, %s", c->findhits->len,
+	      narrow ? "narrowed" : "scanned");
+}
+
+void
+findreset(Client *c)
+{
+	g_free(c->findneedle);
+	g_free(c->findtext);
+	c->findneedle = c->findtext = NULL;
+	c->findcur = 0;
+	g_array_set_size(c->findhits, 0);
+}
+
+void
+framegone(gpointer d, GObject *frame)
+{
+	Client *c = (Client *)d;
+
+	c->frames = g_slist_remove(c->frames, frame);
+	c->findstale = TRUE;
+}
+
+void
+freestate(PageState *s)
+{
+	g_strfreev(s->uris);
+	g_strfreev(s->titles);
+	memset(s, 0, sizeof(*s));
+}
+
+void
+freevalidators(gpointer d)
+{
+	Validators *v = (Validators *)d;
+
+	g_free(v->etag);
+	g_free(v->modified);
+	g_free(v);
+}
+
+void
 fullscreen(Client *c, const Arg *arg)
 {
 	if (c->fullscreen)
@@ -616,6 +1942,28 @@ geopolicyrequested(WebKitWebView *v, WebKitWebFrame *f,
 		webkit_geolocation_policy_deny(d);
 }
 
+Asset *
+getasset(SoupURI *uri)
+{
+	Asset *a;
+	char *u;
+
+	if (!assets)
+		return NULL;
+
+	u = soup_uri_to_string(uri, FALSE);
+	a = findasset(u + strlen("surfasset://"));
+	g_free(u);
+
+	if (a && !a->map) {
+		if (!(a->map = g_mapped_file_new(a->file, FALSE, NULL)))
+			return NULL;
+		a->length = g_mapped_file_get_length(a->map);
+	}
+
+	return a;
+}
+
 const char *
 getatom(Client *c, int a)
 {
@@ -637,6 +1985,73 @@ getatom(Client *c, int a)
 	return buf;
 }
 
+/* Collects garbage in windows that are hidden or were idle for gcinterval. */
+gboolean
+gcidle(gpointer d)
+{
+	Client *c;
+	gint64 now = g_get_monotonic_time(),
+	       idle = (gint64)gcinterval * G_USEC_PER_SEC;
+
+	for (c = clients; c; c = c->next) {
+		if (now - c->lastgc < idle)
+			continue;
+		if (!c->visible || now - c->lastactive >= idle)
+			collectgarbage(c, c->visible ? "idle" : "hidden");
+	}
+
+	return TRUE;
+}
+
+/* Maps instancefile and takes a free slot in it. */
+void
+joininstances(void)
+{
+	size_t len = MAXINSTANCES * sizeof(Instance);
+	int i;
+
+	if ((instancefd = open(instancefile, O_RDWR | O_CREAT, 0600)) < 0
+	    || ftruncate(instancefd, len) < 0
+	    || (instances = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, instancefd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "surf: cannot share %s: %s\n", instancefile,
+		        strerror(errno));
+		instances = NULL;
+		return;
+	}
+
+	flock(instancefd, LOCK_EX);
+	for (i = 0; i < MAXINSTANCES; i++) {
+		if (!instances[i].pid || (kill(instances[i].pid, 0) == -1
+		    && errno == ESRCH)) {
+			instance = &instances[i];
+			memset(instance, 0, sizeof(*instance));
+			instance->pid = getpid();
+			break;
+		}
+	}
+	flock(instancefd, LOCK_UN);
+
+	if (instance)
+		g_timeout_add_seconds(budgetinterval, coordinate, NULL);
+}
+
+/* Returns the resident set size of the process in KiB. */
+long
+getrss(void)
+{
+	long pages = 0;
+	FILE *f;
+
+	if ((f = fopen("/proc/self/statm", "r"))) {
+		if (fscanf(f, "%*d %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
 char *
 geturi(Client *c)
 {
@@ -647,6 +2062,34 @@ geturi(Client *c)
 	return uri;
 }
 
+SiteBudget *
+getbudget(const char *uri)
+{
+	int i;
+
+	for (i = 0; i < LENGTH(budgets); i++) {
+		if (budgets[i].regex && !regexec(&(budgets[i].re), uri, 0,
+		    NULL, 0))
+			return &budgets[i];
+	}
+
+	return NULL;
+}
+
+CachePolicy *
+getcachepolicy(const char *uri)
+{
+	int i;
+
+	for (i = 0; i < LENGTH(cachepolicies); i++) {
+		if (cachepolicies[i].regex && !regexec(&(cachepolicies[i].re),
+		    uri, 0, NULL, 0))
+			return &cachepolicies[i];
+	}
+
+	return NULL;
+}
+
 const gchar *
 getstyle(const char *uri)
 {
@@ -682,17 +2125,549 @@ handleplumb(Client *c, WebKitWebView *w, const gchar *uri)
 	spawn(c, &arg);
 }
 
+/* Appends a visit of uri to historyfile, shared by all surf processes. */
+void
+historyadd(const char *uri)
+{
+	char *line;
+
+	if (historyfd < 0 || !(g_str_has_prefix(uri, "http://")
+	    || g_str_has_prefix(uri, "https://")
+	    || g_str_has_prefix(uri, "file://")))
+		return;
+
+	line = g_strdup_printf("%ld\t%s\n", (long)time(NULL), uri);
+	if (!historypending)
+		historypending = g_string_new(NULL);
+	g_string_append(historypending, line);
+	g_free(line);
+	historyflush(FALSE);
+
+	/* the log is scanned by every query, so it is kept short */
+	if (lseek(historyfd, 0, SEEK_END) > HISTORYFOLD)
+		historyrefold();
+}
+
+/* Orders history lines "score\tvisits\tlast\turi" by descending score. */
+int
+historycmp(const void *a, const void *b)
+{
+	double x = g_ascii_strtod(*(char **)a, NULL),
+	       y = g_ascii_strtod(*(char **)b, NULL);
+
+	return (x < y) - (x > y);
+}
+
+/*
+ * Returns the offset of the first line of the sorted lines p[0..len) which
+ * is not below key, by bisecting the bytes and going back to the start of
+ * the line found.
+ */
+gsize
+historyfirst(const char *p, gsize len, const char *key)
+{
+	gsize lo = 0, hi = len, mid, n = strlen(key);
+	const char *e;
+
+	while (lo < hi) {
+		for (mid = lo + (hi - lo) / 2; mid > lo && p[mid - 1] != '\n';
+		     mid--)
+			;
+		if (strncmp(p + mid, key, n) >= 0) {
+			hi = mid;
+		} else {
+			if (!(e = memchr(p + mid, '\n', len - mid)))
+				return len;
+			lo = e - p + 1;
+		}
+	}
+
+	return lo;
+}
+
+/*
+ * Merges the visits logged in historyfile into the history index, whose
+ * lines are sorted by frecency, and empties the log. The frecency of all
+ * entries is recomputed, which is why this also runs every HISTORYREFOLD
+ * seconds. Next to the index the prefix index is written, with lines
+ * "key\trank\turi" sorted by key, the URI without scheme and "www.", and
+ * rank, its line in the index.
+ */
+/*
+ * Folds the log into the frecency index and the prefix index, and empties
+ * it. The caller holds the lock of the log.
+ */
+void
+historybuild(void)
+{
+	GHashTable *visits;
+	GHashTableIter it;
+	GPtrArray *lines, *keys;
+	char *buf, **l, **f, *data, *tmp, *uri;
+	const char *key;
+	long last, now = time(NULL), *v;
+	double age;
+	int i;
+
+	visits = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	                               g_free);
+
+	if (g_file_get_contents(historyindex, &buf, NULL, NULL)) {
+		for (l = g_strsplit(buf, "\n", -1), i = 0; l[i]; i++) {
+			f = g_strsplit(l[i], "\t", 4);
+			if (g_strv_length(f) == 4) {
+				v = g_new(long, 2);
+				v[0] = strtol(f[1], NULL, 10);
+				v[1] = strtol(f[2], NULL, 10);
+				g_hash_table_replace(visits, g_strdup(f[3]), v);
+			}
+			g_strfreev(f);
+		}
+		g_strfreev(l);
+		g_free(buf);
+	}
+	if (g_file_get_contents(historyfile, &buf, NULL, NULL)) {
+		for (l = g_strsplit(buf, "\n", -1), i = 0; l[i]; i++) {
+			f = g_strsplit(l[i], "\t", 2);
+			if (g_strv_length(f) == 2) {
+				if (!(v = g_hash_table_lookup(visits, f[1]))) {
+					v = g_new0(long, 2);
+					g_hash_table_insert(visits,
+					                    g_strdup(f[1]), v);
+				}
+				last = strtol(f[0], NULL, 10);
+				v[0]++;
+				v[1] = MAX(v[1], last);
+			}
+			g_strfreev(f);
+		}
+		g_strfreev(l);
+		g_free(buf);
+	}
+
+	/* visits weighted by the age of the last one, in days */
+	lines = g_ptr_array_new_with_free_func(g_free);
+	g_hash_table_iter_init(&it, visits);
+	while (g_hash_table_iter_next(&it, (gpointer *)&tmp, (gpointer *)&v)) {
+		age = (now - v[1]) / 86400.0;
+		g_ptr_array_add(lines, g_strdup_printf("%.0f\t%ld\t%ld\t%s\n",
+		                (double)v[0] * (age < 4 ? 100 : age < 14 ? 70 :
+		                age < 31 ? 50 : age < 90 ? 30 : 10),
+		                v[0], v[1], tmp));
+	}
+	qsort(lines->pdata, lines->len, sizeof(gpointer), historycmp);
+	g_ptr_array_add(lines, NULL);
+	data = g_strjoinv("", (char **)lines->pdata);
+
+	keys = g_ptr_array_new_with_free_func(g_free);
+	for (i = 0; i < lines->len - 1; i++) {
+		uri = strchr(strchr(strchr(lines->pdata[i], '\t') + 1, '\t')
+		      + 1, '\t') + 1;
+		key = historykey(uri);
+		g_ptr_array_add(keys, g_strdup_printf("%.*s\t%d\t%s",
+		                (int)strcspn(key, "\n"), key, i, uri));
+	}
+	qsort(keys->pdata, keys->len, sizeof(gpointer), historykeycmp);
+	g_ptr_array_add(keys, NULL);
+
+	tmp = g_strconcat(historyindex, ".new", NULL);
+	if (g_file_set_contents(tmp, data, -1, NULL)
+	    && !rename(tmp, historyindex)) {
+		g_free(data);
+		data = g_strjoinv("", (char **)keys->pdata);
+		if (!g_file_set_contents(tmp, data, -1, NULL)
+		    || rename(tmp, historyprefix))
+			g_remove(historyprefix);
+		if (ftruncate(historyfd, 0) < 0)
+			perror("surf: history");
+	}
+	stats(NULL, "history: %u entries indexed", lines->len - 1);
+
+	g_free(tmp);
+	g_free(data);
+	g_ptr_array_free(keys, TRUE);
+	g_ptr_array_free(lines, TRUE);
+	g_hash_table_destroy(visits);
+}
+
+/*
+ * Appends the visits kept back while the log was locked by a fold, unless
+ * this process is folding it right now. Only wait blocks on the lock.
+ */
+void
+historyflush(gboolean wait)
+{
+	if (historyfd < 0 || !historypending || !historypending->len
+	    || (historyfolder && !wait)
+	    || flock(historyfd, LOCK_EX | (wait ? 0 : LOCK_NB)) < 0)
+		return;
+
+	if (write(historyfd, historypending->str, historypending->len) < 0)
+		perror("surf: history");
+	g_string_truncate(historypending, 0);
+	flock(historyfd, LOCK_UN);
+}
+
+/*
+ * Folds a log that is not empty, in the thread started by historyrefold()
+ * when d is set. Only one surf folds at a time, the others skip it.
+ */
+gpointer
+historyfold(gpointer d)
+{
+	struct stat st;
+
+	if (flock(historyfd, LOCK_EX | LOCK_NB) == 0) {
+		if (fstat(historyfd, &st) == 0 && st.st_size)
+			historybuild();
+		flock(historyfd, LOCK_UN);
+	}
+	if (d)
+		g_idle_add(historyjoin, NULL);
+
+	return NULL;
+}
+
 gboolean
-initdownload(WebKitWebView *view, WebKitDownload *o, Client *c)
+historyjoin(gpointer d)
 {
-	Arg arg;
+	g_thread_join(historyfolder);
+	historyfolder = NULL;
+	historyflush(FALSE);
 
-	updatewinid(c);
-	arg = (Arg)DOWNLOAD((char *)webkit_download_get_uri(o), geturi(c));
-	spawn(c, &arg);
 	return FALSE;
 }
 
+/* Returns uri without its scheme and a leading "www.". */
+const char *
+historykey(const char *uri)
+{
+	const char *p;
+
+	if ((p = strstr(uri, "://")))
+		uri = p + 3;
+	if (!strncmp(uri, "www.", 4))
+		uri += 4;
+
+	return uri;
+}
+
+int
+historykeycmp(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * Returns 2 if pattern is a prefix of uri, leaving out its scheme and
+ * "www.", 1 if it is found elsewhere in it and 0 otherwise.
+ */
+int
+historymatch(const char *uri, gsize len, const char *pattern)
+{
+	const char *p, *e = uri + len;
+	gsize n = strlen(pattern);
+
+	if (!(p = g_strstr_len(uri, len, pattern)))
+		return 0;
+	if (p == uri)
+		return 2;
+
+	if ((uri = g_strstr_len(uri, len, "://")))
+		uri += 3;
+	if (uri && e - uri > 4 && !strncmp(uri, "www.", 4))
+		uri += 4;
+	if (uri && e - uri >= n && !strncmp(uri, pattern, n))
+		return 2;
+
+	return 1;
+}
+
+/*
+ * Prints the historymatches most frecent URIs containing pattern, prefix
+ * matches first. Prefix matches are looked up by bisecting the mapped
+ * prefix index, the others are found by scanning the index in frecency
+ * order until enough matches have been found.
+ */
+void
+historyquery(const char *pattern)
+{
+	GHashTable *seen;
+	GPtrArray *match[2];
+	GMappedFile *map;
+	GArray *ranks;
+	const char *key;
+	char *buf, **l, *p, *e, *q, *line, *uri;
+	gsize len;
+	guint64 r;
+	int i, m, n;
+
+	seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	match[0] = g_ptr_array_new();
+	match[1] = g_ptr_array_new();
+
+	/* visits not yet folded into the index, most recent first */
+	if (g_file_get_contents(historyfile, &buf, NULL, NULL)) {
+		l = g_strsplit(buf, "\n", -1);
+		for (i = g_strv_length(l) - 1; i >= 0; i--) {
+			if (!(uri = strchr(l[i], '\t'))
+			    || g_hash_table_contains(seen, ++uri)
+			    || !(m = historymatch(uri, strlen(uri), pattern)))
+				continue;
+			g_hash_table_add(seen, g_strdup(uri));
+			g_ptr_array_add(match[2 - m], g_strdup(uri));
+		}
+		g_strfreev(l);
+		g_free(buf);
+	}
+
+	/* ranks of the prefix matches in the high, their offsets in the low bits */
+	key = historykey(pattern);
+	if (*key && !strchr(key, '\n')
+	    && (map = g_mapped_file_new(historyprefix, FALSE, NULL))) {
+		p = g_mapped_file_get_contents(map);
+		len = g_mapped_file_get_length(map);
+		e = p + len;
+		n = strlen(key);
+		ranks = g_array_new(FALSE, FALSE, sizeof(guint64));
+		for (q = p + historyfirst(p, len, key);
+		     q < e && !strncmp(q, key, n)
+		     && (uri = memchr(q, '\t', e - q))
+		     && (line = memchr(uri, '\n', e - uri)); q = line + 1) {
+			r = (guint64)strtoul(uri + 1, NULL, 10) << 32
+			    | (guint64)(q - p);
+			g_array_append_val(ranks, r);
+		}
+		g_array_sort(ranks, historyrankcmp);
+		for (i = 0; i < ranks->len && match[0]->len < historymatches;
+		     i++) {
+			uri = p + (g_array_index(ranks, guint64, i)
+			      & 0xffffffff);
+			uri = strchr(strchr(uri, '\t') + 1, '\t') + 1;
+			uri = g_strndup(uri, strcspn(uri, "\n"));
+			if (g_hash_table_contains(seen, uri)) {
+				g_free(uri);
+				continue;
+			}
+			g_hash_table_add(seen, uri);
+			g_ptr_array_add(match[0], uri);
+		}
+		g_array_free(ranks, TRUE);
+		g_mapped_file_unref(map);
+	}
+
+	if ((map = g_mapped_file_new(historyindex, FALSE, NULL))) {
+		p = g_mapped_file_get_contents(map);
+		e = p + g_mapped_file_get_length(map);
+		for (; p < e && match[0]->len + match[1]->len
+		     < historymatches; p = line + 1) {
+			if (!(line = memchr(p, '\n', e - p)))
+				break;
+			for (i = 0, uri = p; i < 3 && uri < line; uri++)
+				i += *uri == '\t';
+			if (!(m = historymatch(uri, line - uri, pattern)))
+				continue;
+			uri = g_strndup(uri, line - uri);
+			if (g_hash_table_contains(seen, uri)) {
+				g_free(uri);
+				continue;
+			}
+			g_hash_table_add(seen, uri);
+			g_ptr_array_add(match[2 - m], uri);
+		}
+		g_mapped_file_unref(map);
+	}
+
+	for (m = 0, n = 0; m < 2; m++) {
+		for (i = 0; i < match[m]->len && n < historymatches; i++, n++)
+			puts(match[m]->pdata[i]);
+	}
+	g_ptr_array_free(match[0], TRUE);
+	g_ptr_array_free(match[1], TRUE);
+	g_hash_table_destroy(seen);
+}
+
+int
+historyrankcmp(const void *a, const void *b)
+{
+	guint64 x = *(guint64 *)a, y = *(guint64 *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Folds the log off the main thread, unless it is empty or being folded. */
+void
+historyrefold(void)
+{
+	if (historyfolder || lseek(historyfd, 0, SEEK_END) <= 0)
+		return;
+	historyfolder = g_thread_new("history", historyfold,
+	                             GINT_TO_POINTER(1));
+}
+
+gboolean
+historytimer(gpointer d)
+{
+	historyrefold();
+	return TRUE;
+}
+
+void
+importassets(const char *pattern)
+{
+	GVariant *index;
+	GVariantIter *entries, *headers;
+	const char *uri, *name, *value, *type, *encoding;
+	char *path, *data, *file, *body, *sum;
+	gsize len, bodylen;
+	guint16 version, status;
+	gboolean b;
+	guint32 u;
+	regex_t re;
+	FILE *f;
+
+	if (regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB))
+		die("Could not compile regex: %s\n", pattern);
+
+	path = g_build_filename(cachefolder, "soup.cache2", NULL);
+	if (!g_file_get_contents(path, &data, &len, NULL))
+		die("Could not read cache index: %s\n", path);
+	g_free(path);
+
+	path = g_build_filename(assetdir, "index", NULL);
+	if (!(f = fopen(path, "a")))
+		die("Could not open file: %s\n", path);
+	g_free(path);
+
+	/* This is the index format written by SoupCache, version 5. */
+	index = g_variant_new_from_data(
+	        G_VARIANT_TYPE("(qa(sbuuuuuqa{ss}))"), data, len, FALSE,
+	        g_free, data);
+	g_variant_get(index, "(qa(sbuuuuuqa{ss}))", &version, &entries);
+	if (version != 5)
+		die("Unsupported cache index version %u\n", version);
+
+	while (g_variant_iter_loop(entries, "(&sbuuuuuqa{ss})", &uri, &b,
+	                           &u, &u, &u, &u, &u, &status, &headers)) {
+		if (status != 200 || !strstr(uri, "://")
+		    || regexec(&re, uri, 0, NULL, 0))
+			continue;
+
+		type = "application/octet-stream";
+		encoding = NULL;
+		while (g_variant_iter_loop(headers, "{&s&s}", &name, &value)) {
+			if (!g_ascii_strcasecmp(name, "Content-Type"))
+				type = value;
+			else if (!g_ascii_strcasecmp(name, "Content-Encoding"))
+				encoding = value;
+		}
+		/* Bodies are stored as received, we only serve plain ones. */
+		if (encoding && g_ascii_strcasecmp(encoding, "identity"))
+			continue;
+
+		path = g_strdup_printf("%s/%u", cachefolder, g_str_hash(uri));
+		if (g_file_get_contents(path, &body, &bodylen, NULL)) {
+			/* named by a digest so different URIs never collide */
+			sum = g_compute_checksum_for_string(G_CHECKSUM_SHA256,
+			      strstr(uri, "://") + 3, -1);
+			file = g_build_filename(assetdir, sum, NULL);
+			g_free(sum);
+			if (g_file_set_contents(file, body, bodylen, NULL)) {
+				fprintf(f, "%s\t%s\t%s\n",
+				        strstr(uri, "://") + 3, file, type);
+				printf("%s\n", uri);
+			}
+			g_free(file);
+			g_free(body);
+		}
+		g_free(path);
+	}
+
+	g_variant_iter_free(entries);
+	g_variant_unref(index);
+	fclose(f);
+	regfree(&re);
+}
+
+/* Whether SoupCache holds a body for uri, named like importassets() reads. */
+gboolean
+incache(const char *uri)
+{
+	char *path;
+	gboolean r;
+
+	path = g_strdup_printf("%s/%u", cachefolder, g_str_hash(uri));
+	r = g_file_test(path, G_FILE_TEST_EXISTS);
+	g_free(path);
+
+	return r;
+}
+
+gboolean
+initdownload(WebKitWebView *view, WebKitDownload *o, Client *c)
+{
+	WebKitNetworkResponse *res;
+	SoupMessage *msg = NULL;
+	Transfer *t;
+	const char *etag;
+	char *name, *path, *uri;
+	goffset total;
+	int i;
+
+	name = g_path_get_basename(webkit_download_get_suggested_filename(o));
+	if (!strcmp(name, ".") || !strcmp(name, "/")) {
+		g_free(name);
+		name = g_strdup("download");
+	}
+	path = transferpath(name);
+	g_free(name);
+
+	/*
+	 * Large files from servers accepting ranges are fetched in parallel
+	 * parts that survive interruptions, see transferstart().
+	 */
+	if ((res = webkit_download_get_network_response(o)))
+		msg = webkit_network_response_get_message(res);
+	total = webkit_download_get_total_size(o);
+	if (downloadsegments > 1 && msg && total >= segmentthreshold
+	    && !g_strcmp0(soup_message_headers_get_one(msg->response_headers,
+	    "Accept-Ranges"), "bytes") && (t = transfernew(c, path))) {
+		t->uri = g_strdup(webkit_download_get_uri(o));
+		t->referer = g_strdup(geturi(c));
+		etag = soup_message_headers_get_one(msg->response_headers,
+		                                    "ETag");
+		if (etag && !g_str_has_prefix(etag, "W/"))
+			t->etag = g_strdup(etag);
+		t->total = total;
+		t->nseg = MIN(downloadsegments, MAXSEGMENTS);
+		for (i = 0; i < t->nseg; i++) {
+			t->seg[i].start = t->seg[i].pos = total / t->nseg * i;
+			t->seg[i].end = i == t->nseg - 1 ? total - 1
+			                : total / t->nseg * (i + 1) - 1;
+		}
+		transferstart(t);
+		g_free(path);
+		return FALSE;
+	}
+
+	/*
+	 * Otherwise let WebKit write the response it already has to
+	 * downloaddir, instead of fetching it again.
+	 */
+	uri = g_filename_to_uri(path, NULL, NULL);
+	webkit_download_set_destination_uri(o, uri);
+	g_free(uri);
+	g_free(path);
+
+	c->downloads = g_slist_prepend(c->downloads, g_object_ref(o));
+	g_signal_connect(G_OBJECT(o), "notify::progress",
+	                 G_CALLBACK(downloadstatus), c);
+	g_signal_connect(G_OBJECT(o), "notify::status",
+	                 G_CALLBACK(downloadstatus), c);
+
+	return TRUE;
+}
+
 void
 inspector(Client *c, const Arg *arg)
 {
@@ -748,6 +2723,32 @@ inspector_finished(WebKitWebInspector *i, Client *c)
 	g_free(c->inspector);
 }
 
+/*
+ * Returns s as a JavaScript string literal, with everything but printable
+ * ASCII escaped as UTF-16 units, so it compares equal to the DOM's string.
+ */
+char *
+jsquote(const char *s)
+{
+	GString *q = g_string_new("\"");
+	gunichar2 *u;
+	glong i, n;
+
+	if ((u = g_utf8_to_utf16(s, -1, NULL, &n, NULL))) {
+		for (i = 0; i < n; i++) {
+			if (u[i] >= 0x20 && u[i] < 0x7f && u[i] != '"'
+			    && u[i] != '\\')
+				g_string_append_c(q, u[i]);
+			else
+				g_string_append_printf(q, "\\u%04x", u[i]);
+		}
+		g_free(u);
+	}
+	g_string_append_c(q, '"');
+
+	return g_string_free(q, FALSE);
+}
+
 gboolean
 keypress(GtkAccelGroup *group, GObject *obj, guint key, GdkModifierType mods,
          Client *c)
@@ -770,28 +2771,230 @@ keypress(GtkAccelGroup *group, GObject *obj, guint key, GdkModifierType mods,
 	return processed;
 }
 
-void
-linkhover(WebKitWebView *v, const char* t, const char* l, Client *c)
+/*
+ * Whether an <img> or <iframe> of the page showing uri lies below the
+ * viewport. Elements missing from the index are taken to be above it.
+ */
+gboolean
+lazybelow(Client *c, const char *uri)
 {
-	if (l) {
-		c->linkhover = copystr(&c->linkhover, l);
-	} else if (c->linkhover) {
-		free(c->linkhover);
-		c->linkhover = NULL;
-	}
-	updatetitle(c);
-}
+	WebKitDOMDocument *doc;
+	gpointer top;
 
+	if (!(doc = webkit_web_view_get_dom_document(c->view)))
+		return FALSE;
+
+	if (!c->lazyindexed || webkit_dom_html_collection_get_length(
+	    webkit_dom_document_get_images(doc)) >= 2 * c->lazyindexed)
+		lazyindex(c);
+	if (!(top = g_hash_table_lookup(c->lazytops, uri)))
+		return FALSE;
+
+	return GPOINTER_TO_INT(top) - 1 >= lazybottom(c);
+}
+
+/* Returns the page offset up to which images are loaded, in pixels. */
+gdouble
+lazybottom(Client *c)
+{
+	GtkAdjustment *a;
+
+	a = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(c->scroll));
+
+	return (gtk_adjustment_get_value(a) + gtk_adjustment_get_page_size(a)
+	        * (1 + lazymargin)) / webkit_web_view_get_zoom_level(c->view);
+}
+
+/*
+ * Records the page offsets of the images and inline frames of c's page by
+ * their source. Offsets change with layout, so the index is dropped after a
+ * layout or scroll, and rebuilt early only once the page has twice as many
+ * images as were indexed, which keeps the work linear while it is parsed.
+ */
 void
-loadstatuschange(WebKitWebView *view, GParamSpec *pspec, Client *c)
+lazyindex(Client *c)
+{
+	WebKitDOMDocument *doc;
+	WebKitDOMHTMLCollection *images;
+	WebKitDOMNodeList *frames;
+	WebKitDOMNode *n;
+	gulong i, len;
+	char *src;
+
+	g_hash_table_remove_all(c->lazytops);
+	if (!(doc = webkit_web_view_get_dom_document(c->view)))
+		return;
+
+	images = webkit_dom_document_get_images(doc);
+	len = webkit_dom_html_collection_get_length(images);
+	for (i = 0; i < len; i++) {
+		n = webkit_dom_html_collection_item(images, i);
+		src = webkit_dom_html_image_element_get_src(
+		      WEBKIT_DOM_HTML_IMAGE_ELEMENT(n));
+		g_hash_table_replace(c->lazytops, src, GINT_TO_POINTER(
+		                     lazytop(WEBKIT_DOM_ELEMENT(n)) + 1));
+	}
+	c->lazyindexed = MAX(len, 1);
+
+	frames = webkit_dom_document_get_elements_by_tag_name(doc, "iframe");
+	len = webkit_dom_node_list_get_length(frames);
+	for (i = 0; i < len; i++) {
+		n = webkit_dom_node_list_item(frames, i);
+		src = webkit_dom_html_iframe_element_get_src(
+		      WEBKIT_DOM_HTML_IFRAME_ELEMENT(n));
+		g_hash_table_replace(c->lazytops, src, GINT_TO_POINTER(
+		                     lazytop(WEBKIT_DOM_ELEMENT(n)) + 1));
+	}
+}
+
+/* Returns the page offset of e in pixels. */
+glong
+lazytop(WebKitDOMElement *e)
+{
+	glong top = 0;
+
+	for (; e; e = webkit_dom_element_get_offset_parent(e))
+		top += webkit_dom_element_get_offset_top(e);
+
+	return top;
+}
+
+/*
+ * Deferred images and frames are loaded by giving their element its source
+ * again. Images go through another source first, as setting the same one
+ * is no change to WebKit.
+ */
+void
+lazyrelease(Client *c)
+{
+	WebKitDOMDocument *doc;
+	WebKitDOMHTMLCollection *images;
+	WebKitDOMNodeList *frames;
+	WebKitDOMNode *n;
+	gdouble bottom;
+	gulong i, len;
+	char *src;
+
+	if (c->lazydeferred == c->lazyreleased
+	    || !(doc = webkit_web_view_get_dom_document(c->view)))
+		return;
+
+	bottom = lazybottom(c);
+	images = webkit_dom_document_get_images(doc);
+	len = webkit_dom_html_collection_get_length(images);
+	for (i = 0; i < len; i++) {
+		n = webkit_dom_html_collection_item(images, i);
+		src = webkit_dom_html_image_element_get_src(
+		      WEBKIT_DOM_HTML_IMAGE_ELEMENT(n));
+		if (GPOINTER_TO_INT(g_hash_table_lookup(c->lazy, src)) == 1
+		    && lazytop(WEBKIT_DOM_ELEMENT(n)) < bottom) {
+			g_hash_table_replace(c->lazy, g_strdup(src),
+			                     GINT_TO_POINTER(2));
+			c->lazyreleased++;
+			webkit_dom_html_image_element_set_src(
+			    WEBKIT_DOM_HTML_IMAGE_ELEMENT(n), "about:blank");
+			webkit_dom_html_image_element_set_src(
+			    WEBKIT_DOM_HTML_IMAGE_ELEMENT(n), src);
+		}
+		g_free(src);
+	}
+
+	frames = webkit_dom_document_get_elements_by_tag_name(doc, "iframe");
+	len = webkit_dom_node_list_get_length(frames);
+	for (i = 0; i < len; i++) {
+		n = webkit_dom_node_list_item(frames, i);
+		src = webkit_dom_html_iframe_element_get_src(
+		      WEBKIT_DOM_HTML_IFRAME_ELEMENT(n));
+		if (GPOINTER_TO_INT(g_hash_table_lookup(c->lazy, src)) == 1
+		    && lazytop(WEBKIT_DOM_ELEMENT(n)) < bottom) {
+			g_hash_table_replace(c->lazy, g_strdup(src),
+			                     GINT_TO_POINTER(2));
+			c->lazyreleased++;
+			webkit_dom_html_iframe_element_set_src(
+			    WEBKIT_DOM_HTML_IFRAME_ELEMENT(n), src);
+		}
+		g_free(src);
+	}
+}
+
+/*
+ * The saving is estimated from the average size of the images which did
+ * load, WebKit does not expose decoding times.
+ */
+void
+lazyreport(Client *c)
+{
+	guint left = c->lazydeferred - c->lazyreleased;
+
+	if (!c->lazydeferred)
+		return;
+
+	stats(c, "lazy: %u of %u images never loaded, "
+	      "~%lu bytes saved", left, c->lazydeferred, c->imgcount
+	      ? (unsigned long)(c->imgbytes / c->imgcount * left) : 0UL);
+}
+
+void
+lazyscroll(GtkAdjustment *a, Client *c)
+{
+	c->lazyindexed = 0;
+	lazyrelease(c);
+}
+
+void
+linkhover(WebKitWebView *v, const char* t, const char* l, Client *c)
+{
+	if (l) {
+		c->linkhover = copystr(&c->linkhover, l);
+	} else if (c->linkhover) {
+		free(c->linkhover);
+		c->linkhover = NULL;
+	}
+	updatetitle(c);
+}
+
+/* Keeps the state of c in step with the page in its view reaching status. */
+void
+loadstatus(Client *c, WebKitLoadStatus status)
 {
 	WebKitWebFrame *frame;
 	WebKitWebDataSource *src;
 	WebKitNetworkRequest *request;
 	SoupMessage *msg;
 	char *uri;
+	Arg a;
 
-	switch (webkit_web_view_get_load_status (c->view)) {
+	switch (status) {
+	case WEBKIT_LOAD_PROVISIONAL:
+		c->loadstart = g_get_monotonic_time();
+		findreset(c);
+		lazyreport(c);
+		g_hash_table_remove_all(c->lazy);
+		g_hash_table_remove_all(c->stale);
+		c->lazydeferred = c->lazyreleased = c->lazyindexed = 0;
+		c->imgcount = c->imgbytes = 0;
+		if (c->cut)
+			stats(c, "budget: %u resources cut", c->cut);
+		if (enablepagecache && c->bytes) {
+			c->cachedpages++;
+			c->cachedbytes += c->bytes;
+			if (c->cachedpages > pagecachepages
+			    || c->cachedbytes > pagecachebytes)
+				droppagecache(c);
+		}
+		c->budget = NULL;
+		c->requests = c->cut = c->bytes = 0;
+		memset(c->typebytes, 0, sizeof(c->typebytes));
+		break;
+	case WEBKIT_LOAD_FIRST_VISUALLY_NON_EMPTY_LAYOUT:
+		stats(c, "first paint after %ld ms, scheduler %s",
+		      (long)(g_get_monotonic_time() - c->loadstart) / 1000,
+		      enablescheduler ? "on" : "off");
+		c->lazyindexed = 0;
+		lazyrelease(c);
+		if (c->playing)
+			stopmedia(c);
+		break;
 	case WEBKIT_LOAD_COMMITTED:
 		uri = geturi(c);
 		if (strstr(uri, "https://") == uri) {
@@ -803,6 +3006,13 @@ loadstatuschange(WebKitWebView *view, GParamSpec *pspec, Client *c)
 			               & SOUP_MESSAGE_CERTIFICATE_TRUSTED);
 		}
 		setatom(c, AtomUri, uri);
+		historyadd(uri);
+		c->budget = getbudget(uri);
+		c->playing = FALSE;
+		if (videosites && !regexec(&videore, uri, 0, NULL, 0)) {
+			a.v = uri;
+			playvideo(c, &a);
+		}
 
 		if (enablestyle)
 			setstyle(c, getstyle(uri));
@@ -810,16 +3020,275 @@ loadstatuschange(WebKitWebView *view, GParamSpec *pspec, Client *c)
 	case WEBKIT_LOAD_FINISHED:
 		c->progress = 100;
 		updatetitle(c);
+		stats(c, "loaded after %ld ms",
+		      (long)(g_get_monotonic_time() - c->loadstart) / 1000);
+		releasedeferred();
+		c->lazyindexed = 0;
+		lazyrelease(c);
+		lazyreport(c);
+		if (c->playing)
+			stopmedia(c);
+		if (c->restorescroll) {
+			c->restorescroll = FALSE;
+			gtk_adjustment_set_value(
+			    gtk_scrolled_window_get_hadjustment(
+			    GTK_SCROLLED_WINDOW(c->scroll)), c->state.x);
+			gtk_adjustment_set_value(
+			    gtk_scrolled_window_get_vadjustment(
+			    GTK_SCROLLED_WINDOW(c->scroll)), c->state.y);
+		}
+		if (c->visible)
+			takesnapshot(c);
+		stats(c, "%lu bytes in %u requests, %u cut",
+		      (unsigned long)c->bytes, c->requests, c->cut);
 		if (diskcache) {
 			soup_cache_flush(diskcache);
 			soup_cache_dump(diskcache);
 		}
+		if (c->navstart) {
+			stats(c, "back/forward after %ld ms, page cache %s",
+			      (long)(g_get_monotonic_time() - c->navstart)
+			      / 1000, enablepagecache ? "on" : "off");
+			c->navstart = 0;
+		}
+		savesession();
+		if (c->restoring) {
+			c->restoring = FALSE;
+			restorenext();
+		}
+		if (c->cachepolicy && !c->offline)
+			revalidate(c);
+		c->offline = c->retried = c->cacheonly = FALSE;
+		c->findstale = TRUE;
+		if (triminterval)
+			g_idle_add(trimmemory, "load");
+		break;
+	case WEBKIT_LOAD_FAILED:
+		c->offline = c->cacheonly = FALSE;
+		if (c->restoring) {
+			c->restoring = FALSE;
+			restorenext();
+		}
 		break;
 	default:
 		break;
 	}
 }
 
+void
+loadstatuschange(WebKitWebView *view, GParamSpec *pspec, Client *c)
+{
+	loadstatus(c, webkit_web_view_get_load_status(c->view));
+}
+
+/*
+ * Maps an archive written by archive() and adds its resources to the
+ * archive of c, pointing into the mapping. Returns the URI of its page.
+ */
+char *
+loadarchive(Client *c, const char *path)
+{
+	GMappedFile *map;
+	Asset *a;
+	char *data, *p, *line, *end, *uri, *entry, **fields;
+	gsize len, base;
+	gint64 start = g_get_monotonic_time();
+	int n = 0;
+
+	if (!(map = g_mapped_file_new(path, FALSE, NULL)))
+		return NULL;
+	data = g_mapped_file_get_contents(map);
+	len = g_mapped_file_get_length(map);
+
+	/* the index ends with an empty line, the bodies follow it */
+	if (!g_str_has_prefix(data, "SURFARCHIVE 1\t")
+	    || !(end = g_strstr_len(data, len, "\n\n"))) {
+		g_mapped_file_unref(map);
+		return NULL;
+	}
+	base = end + 2 - data;
+	line = memchr(data, '\n', len);
+	uri = g_strndup(data + strlen("SURFARCHIVE 1\t"),
+	                line - data - strlen("SURFARCHIVE 1\t"));
+
+	/* references the archive lacks go out with the scheme of its page */
+	if ((p = strstr(uri, "://"))) {
+		g_hash_table_replace(assetschemes,
+		                     g_strndup(p + 3, strcspn(p + 3, "/")),
+		                     g_str_has_prefix(uri, "https://")
+		                     ? "https" : "http");
+	}
+	if (!c->archive) {
+		c->archive = g_hash_table_new_full(g_str_hash, g_str_equal,
+		                                   g_free, assetfree);
+		c->archiveid = ++archives;
+	}
+
+	for (p = line + 1; p < end; p = line + 1) {
+		line = memchr(p, '\n', end + 1 - p);
+		entry = g_strndup(p, line - p);
+		fields = g_strsplit(entry, "\t", 4);
+		g_free(entry);
+		if (g_strv_length(fields) != 4) {
+			g_strfreev(fields);
+			continue;
+		}
+
+		a = g_new0(Asset, 1);
+		a->file = g_strdup(path);
+		a->type = fields[1];
+		a->offset = base + strtoul(fields[2], NULL, 10);
+		a->length = strtoul(fields[3], NULL, 10);
+		g_free(fields[2]);
+		g_free(fields[3]);
+		if (a->offset + a->length > len) {
+			assetfree(a);
+			g_free(fields[0]);
+		} else {
+			a->map = g_mapped_file_ref(map);
+			g_hash_table_replace(c->archive, fields[0], a);
+			n++;
+		}
+		g_free(fields);
+	}
+	g_mapped_file_unref(map);
+
+	stats(c, "mapped archive %s, %d resources in %ld ms", path, n,
+	      (long)(g_get_monotonic_time() - start) / 1000);
+
+	return uri;
+}
+
+void
+loadassets(void)
+{
+	Asset *a;
+	char *path, *data, **lines, **fields;
+	int i;
+
+	/* archives need the store for their requests, even if empty */
+	assets = g_hash_table_new(g_str_hash, g_str_equal);
+	assetschemes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	                                     NULL);
+
+	path = g_build_filename(assetdir, "index", NULL);
+	if (!g_file_get_contents(path, &data, NULL, NULL)) {
+		g_free(path);
+		return;
+	}
+	g_free(path);
+	lines = g_strsplit(data, "\n", -1);
+	for (i = 0; lines[i]; i++) {
+		fields = g_strsplit(lines[i], "\t", 3);
+		if (g_strv_length(fields) == 3) {
+			a = g_new0(Asset, 1);
+			a->file = fields[1];
+			a->type = fields[2];
+			/* later imports of the same URI take precedence */
+			g_hash_table_replace(assets, fields[0], a);
+			g_free(fields);
+		} else {
+			g_strfreev(fields);
+		}
+	}
+	g_strfreev(lines);
+	g_free(data);
+}
+
+/*
+ * Opens the windows saved in sessiondir by one surf process that is no
+ * longer running, with their pages left for setvisible() to load. Each
+ * surf started with -R takes over the file of another such process, so a
+ * set of restarted processes, like the tabs of tabbed, reopen one saved
+ * process each, embedded where they were started.
+ */
+int
+loadsession(void)
+{
+	GDir *dir;
+	GKeyFile *kf;
+	Client *c;
+	const char *name;
+	char *path, **groups;
+	gsize i, n, len;
+	int restored = 0;
+	pid_t pid;
+
+	if (!(dir = g_dir_open(sessiondir, 0, NULL)))
+		return 0;
+
+	while (!restored && (name = g_dir_read_name(dir))) {
+		pid = strtol(name, NULL, 10);
+		if (pid <= 0 || pid == getpid() || kill(pid, 0) == 0)
+			continue;
+
+		/* whoever renames it first owns it */
+		path = g_build_filename(sessiondir, name, NULL);
+		if (rename(path, sessionfile) < 0) {
+			g_free(path);
+			continue;
+		}
+		g_free(path);
+
+		kf = g_key_file_new();
+		if (g_key_file_load_from_file(kf, sessionfile,
+		    G_KEY_FILE_NONE, NULL)) {
+			groups = g_key_file_get_groups(kf, &n);
+			for (i = 0; i < n; i++) {
+				c = newclient();
+				c->state.uris = g_key_file_get_string_list(kf,
+				                groups[i], "uris", &len, NULL);
+				c->state.titles = g_key_file_get_string_list(kf,
+				                  groups[i], "titles", NULL, NULL);
+				c->state.n = c->state.uris && c->state.titles ?
+				             len : 0;
+				c->state.current = g_key_file_get_integer(kf,
+				                   groups[i], "current", NULL);
+				c->state.x = g_key_file_get_double(kf,
+				             groups[i], "x", NULL);
+				c->state.y = g_key_file_get_double(kf,
+				             groups[i], "y", NULL);
+				c->state.zoom = g_key_file_get_double(kf,
+				                groups[i], "zoom", NULL);
+				c->pending = TRUE;
+				restored++;
+			}
+			g_strfreev(groups);
+		}
+		g_key_file_free(kf);
+	}
+	g_dir_close(dir);
+
+	return restored;
+}
+
+/*
+ * Loads the page again from the disk cache when the network could not be
+ * reached, whatever the age of the cached copies. If that fails as well,
+ * the error is shown.
+ */
+gboolean
+loaderror(WebKitWebView *v, WebKitWebFrame *f, gchar *uri, GError *err,
+          Client *c)
+{
+	if (f != webkit_web_view_get_main_frame(v))
+		return FALSE;
+	if (c->retried) {
+		c->retried = FALSE;
+		return FALSE;
+	}
+	if (!diskcache || err->domain != SOUP_HTTP_ERROR
+	    || !SOUP_STATUS_IS_TRANSPORT_ERROR(err->code))
+		return FALSE;
+
+	fprintf(stderr, "surf: %s: %s, loading cached copy\n", uri,
+	        err->message);
+	c->offline = c->retried = TRUE;
+	webkit_web_view_load_uri(v, uri);
+
+	return TRUE;
+}
+
 void
 loaduri(Client *c, const Arg *arg)
 {
@@ -834,8 +3303,16 @@ loaduri(Client *c, const Arg *arg)
 	/* In case it's a file path. */
 	if (stat(uri, &st) == 0) {
 		rp = realpath(uri, NULL);
-		u = g_strdup_printf("file://%s", rp);
+		if (!g_str_has_suffix(rp, ".surfarchive")
+		    || !(u = loadarchive(c, rp)))
+			u = g_strdup_printf("file://%s", rp);
 		free(rp);
+	} else if (g_str_has_prefix(uri, "file://")
+	           && g_str_has_suffix(uri, ".surfarchive")
+	           && (rp = g_filename_from_uri(uri, NULL, NULL))) {
+		if (!(u = loadarchive(c, rp)))
+			u = g_strdup(uri);
+		g_free(rp);
 	} else {
 		u = g_strrstr(uri, "://") ? g_strdup(uri)
 		    : g_strdup_printf("http://%s", uri);
@@ -859,6 +3336,8 @@ void
 navigate(Client *c, const Arg *arg)
 {
 	int steps = *(int *)arg;
+
+	c->navstart = g_get_monotonic_time();
 	webkit_web_view_go_back_or_forward(c->view, steps);
 }
 
@@ -866,18 +3345,21 @@ Client *
 newclient(void)
 {
 	Client *c;
-	WebKitWebSettings *settings;
-	WebKitWebFrame *frame;
 	GdkGeometry hints = { 1, 1 };
-	GdkScreen *screen;
-	gdouble dpi;
-	char *ua;
 
 	if (!(c = calloc(1, sizeof(Client))))
 		die("Cannot malloc!\n");
 
 	c->title = NULL;
 	c->progress = 100;
+	c->lazy = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	c->lazytops = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	                                    NULL);
+	c->findhits = g_array_new(FALSE, FALSE, sizeof(gsize));
+	c->stale = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	                                 freevalidators);
+	c->plugins = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	                                   NULL);
 
 	/* Window */
 	if (embed) {
@@ -906,6 +3388,21 @@ newclient(void)
 	g_signal_connect(G_OBJECT(c->win),
 	                 "leave_notify_event",
 			 G_CALLBACK(titlechangeleave), c);
+	g_signal_connect(G_OBJECT(c->win),
+	                 "map-event",
+			 G_CALLBACK(winevent), c);
+	g_signal_connect(G_OBJECT(c->win),
+	                 "unmap-event",
+			 G_CALLBACK(winevent), c);
+	g_signal_connect(G_OBJECT(c->win),
+	                 "visibility-notify-event",
+			 G_CALLBACK(winevent), c);
+	g_signal_connect(G_OBJECT(c->win),
+	                 "focus-in-event",
+			 G_CALLBACK(winevent), c);
+	g_signal_connect(G_OBJECT(c->win),
+	                 "focus-out-event",
+			 G_CALLBACK(winevent), c);
 
 	if (!kioskmode)
 		addaccelgroup(c);
@@ -918,58 +3415,11 @@ newclient(void)
 	gtk_paned_pack1(GTK_PANED(c->pane), c->vbox, TRUE, TRUE);
 
 	/* Webview */
-	c->view = WEBKIT_WEB_VIEW(webkit_web_view_new());
-
-	g_signal_connect(G_OBJECT(c->view),
-	                 "notify::title",
-			 G_CALLBACK(titlechange), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "hovering-over-link",
-			 G_CALLBACK(linkhover), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "geolocation-policy-decision-requested",
-			 G_CALLBACK(geopolicyrequested), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "create-web-view",
-			 G_CALLBACK(createwindow), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "new-window-policy-decision-requested",
-			 G_CALLBACK(decidewindow), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "mime-type-policy-decision-requested",
-			 G_CALLBACK(decidedownload), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "window-object-cleared",
-			 G_CALLBACK(windowobjectcleared), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "notify::load-status",
-			 G_CALLBACK(loadstatuschange), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "notify::progress",
-			 G_CALLBACK(progresschange), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "download-requested",
-			 G_CALLBACK(initdownload), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "button-release-event",
-			 G_CALLBACK(buttonrelease), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "context-menu",
-			 G_CALLBACK(contextmenu), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "resource-request-starting",
-			 G_CALLBACK(beforerequest), c);
-	g_signal_connect(G_OBJECT(c->view),
-	                 "should-show-delete-interface-for-element",
-			 G_CALLBACK(deletion_interface), c);
+	c->view = newview(c);
 
 	/* Scrolled Window */
 	c->scroll = gtk_scrolled_window_new(NULL, NULL);
 
-	frame = webkit_web_view_get_main_frame(WEBKIT_WEB_VIEW(c->view));
-	g_signal_connect(G_OBJECT(frame), "scrollbars-policy-changed",
-	                 G_CALLBACK(gtk_true), NULL);
-
 	if (!enablescrollbars) {
 		gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(c->scroll),
 		                               GTK_POLICY_NEVER,
@@ -980,6 +3430,12 @@ newclient(void)
 					       GTK_POLICY_AUTOMATIC);
 	}
 
+	if (lazyimages) {
+		g_signal_connect(G_OBJECT(gtk_scrolled_window_get_vadjustment(
+		                 GTK_SCROLLED_WINDOW(c->scroll))),
+		                 "value-changed", G_CALLBACK(lazyscroll), c);
+	}
+
 	/* Arranging */
 	gtk_container_add(GTK_CONTAINER(c->scroll), GTK_WIDGET(c->view));
 	gtk_container_add(GTK_CONTAINER(c->win), c->pane);
@@ -998,11 +3454,112 @@ newclient(void)
 	                              GDK_HINT_MIN_SIZE);
 	gdk_window_set_events(GTK_WIDGET(c->win)->window, GDK_ALL_EVENTS_MASK);
 	gdk_window_add_filter(GTK_WIDGET(c->win)->window, processx, c);
-	webkit_web_view_set_full_content_zoom(c->view, TRUE);
+
+	if (runinfullscreen)
+		fullscreen(c, NULL);
+
+	setatom(c, AtomFind, "");
+	setatom(c, AtomUri, "about:blank");
+
+	c->next = clients;
+	clients = c;
+
+	if (showxid) {
+		gdk_display_sync(gtk_widget_get_display(c->win));
+		printf("%u\n",
+		       (guint)GDK_WINDOW_XID(GTK_WIDGET(c->win)->window));
+		fflush(NULL);
+                if (fclose(stdout) != 0) {
+			die("Error closing stdout");
+                }
+	}
+
+	return c;
+}
+
+/* Creates a web view for c with all handlers and settings applied. */
+WebKitWebView *
+newview(Client *c)
+{
+	WebKitWebView *v;
+	WebKitWebSettings *settings;
+	WebKitWebFrame *frame;
+	GdkScreen *screen;
+	gdouble dpi;
+	char *ua;
+
+	v = WEBKIT_WEB_VIEW(webkit_web_view_new());
+
+	g_signal_connect(G_OBJECT(v),
+	                 "notify::title",
+			 G_CALLBACK(titlechange), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "hovering-over-link",
+			 G_CALLBACK(linkhover), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "geolocation-policy-decision-requested",
+			 G_CALLBACK(geopolicyrequested), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "create-web-view",
+			 G_CALLBACK(createwindow), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "create-plugin-widget",
+			 G_CALLBACK(createplugin), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "new-window-policy-decision-requested",
+			 G_CALLBACK(decidewindow), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "navigation-policy-decision-requested",
+			 G_CALLBACK(decidenavigation), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "mime-type-policy-decision-requested",
+			 G_CALLBACK(decidedownload), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "window-object-cleared",
+			 G_CALLBACK(windowobjectcleared), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "notify::load-status",
+			 G_CALLBACK(loadstatuschange), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "notify::progress",
+			 G_CALLBACK(progresschange), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "download-requested",
+			 G_CALLBACK(initdownload), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "button-release-event",
+			 G_CALLBACK(buttonrelease), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "context-menu",
+			 G_CALLBACK(contextmenu), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "resource-request-starting",
+			 G_CALLBACK(beforerequest), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "load-error",
+			 G_CALLBACK(loaderror), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "should-show-delete-interface-for-element",
+			 G_CALLBACK(deletion_interface), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "resource-load-finished",
+			 G_CALLBACK(resourcefinished), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "resource-content-length-received",
+			 G_CALLBACK(contentreceived), c);
+	g_signal_connect(G_OBJECT(v),
+	                 "resource-response-received",
+			 G_CALLBACK(responsereceived), c);
+
+	frame = webkit_web_view_get_main_frame(v);
+	g_signal_connect(G_OBJECT(frame), "scrollbars-policy-changed",
+	                 G_CALLBACK(gtk_true), NULL);
+
+	webkit_web_view_set_full_content_zoom(v, TRUE);
 
 	runscript(frame);
 
-	settings = webkit_web_view_get_settings(c->view);
+	settings = webkit_web_view_get_settings(v);
 	if (!(ua = getenv("SURF_USERAGENT")))
 		ua = useragent;
 	g_object_set(G_OBJECT(settings), "user-agent", ua, NULL);
@@ -1022,8 +3579,12 @@ newclient(void)
 	             "default-font-size", defaultfontsize, NULL);
 	g_object_set(G_OBJECT(settings),
 	             "resizable-text-areas", 1, NULL);
-	if (enablestyle)
-		setstyle(c, getstyle("about:blank"));
+	g_object_set(G_OBJECT(settings),
+	             "enable-page-cache", enablepagecache, NULL);
+	if (enablestyle) {
+		g_object_set(G_OBJECT(settings), "user-stylesheet-uri",
+		             getstyle("about:blank"), NULL);
+	}
 
 	/*
 	 * While stupid, CSS specifies that a pixel represents 1/96 of an inch.
@@ -1031,20 +3592,20 @@ newclient(void)
 	 * It is equivalent to firefox's "layout.css.devPixelsPerPx" setting.
 	 */
 	if (zoomto96dpi) {
-		screen = gdk_window_get_screen(GTK_WIDGET(c->win)->window);
+		screen = gtk_widget_get_screen(c->win);
 		dpi = gdk_screen_get_resolution(screen);
 		if (dpi != -1) {
 			g_object_set(G_OBJECT(settings),
 			             "enforce-96-dpi", true, NULL);
-			webkit_web_view_set_zoom_level(c->view, dpi/96);
+			webkit_web_view_set_zoom_level(v, dpi/96);
 		}
 	}
 	/* This might conflict with _zoomto96dpi_. */
 	if (zoomlevel != 1.0)
-		webkit_web_view_set_zoom_level(c->view, zoomlevel);
+		webkit_web_view_set_zoom_level(v, zoomlevel);
 
 	if (enableinspector) {
-		c->inspector = webkit_web_view_get_inspector(c->view);
+		c->inspector = webkit_web_view_get_inspector(v);
 		g_signal_connect(G_OBJECT(c->inspector), "inspect-web-view",
 		                 G_CALLBACK(inspector_new), c);
 		g_signal_connect(G_OBJECT(c->inspector), "show-window",
@@ -1056,35 +3617,17 @@ newclient(void)
 		c->isinspecting = false;
 	}
 
-	if (runinfullscreen)
-		fullscreen(c, NULL);
-
-	setatom(c, AtomFind, "");
-	setatom(c, AtomUri, "about:blank");
 	if (hidebackground)
-		webkit_web_view_set_transparent(c->view, TRUE);
+		webkit_web_view_set_transparent(v, TRUE);
 
-	c->next = clients;
-	clients = c;
-
-	if (showxid) {
-		gdk_display_sync(gtk_widget_get_display(c->win));
-		printf("%u\n",
-		       (guint)GDK_WINDOW_XID(GTK_WIDGET(c->win)->window));
-		fflush(NULL);
-                if (fclose(stdout) != 0) {
-			die("Error closing stdout");
-                }
-	}
-
-	return c;
+	return v;
 }
 
 void
 newwindow(Client *c, const Arg *arg, gboolean noembed)
 {
 	guint i = 0;
-	const char *cmd[18], *uri;
+	const char *cmd[20], *uri;
 	const Arg a = { .v = (void *)cmd };
 	char tmp[64];
 
@@ -1104,8 +3647,12 @@ newwindow(Client *c, const Arg *arg, gboolean noembed)
 		cmd[i++] = "-i";
 	if (kioskmode)
 		cmd[i++] = "-k";
+	if (enablestats)
+		cmd[i++] = "-L";
 	if (!enableplugins)
 		cmd[i++] = "-p";
+	if (!enablescheduler)
+		cmd[i++] = "-q";
 	if (!enablescripts)
 		cmd[i++] = "-s";
 	if (showxid)
@@ -1179,12 +3726,498 @@ pasteuri(GtkClipboard *clipboard, const char *text, gpointer d)
 		loaduri((Client *) d, &arg);
 }
 
+/*
+ * Holds the handlers of v that update the title, the progress and the load
+ * counters of c, while v preloads offscreen. Those deciding policies and
+ * running scripts stay connected, so the preloaded page is the one c would
+ * have loaded.
+ */
 void
-print(Client *c, const Arg *arg)
+playlisthold(WebKitWebView *v, Client *c, gboolean hold)
+{
+	static const char *signals[] = {
+		"notify::title", "notify::progress", "notify::load-status",
+		"hovering-over-link", "load-error", "resource-load-finished",
+		"resource-content-length-received",
+	};
+	GSignalMatchType match = G_SIGNAL_MATCH_ID | G_SIGNAL_MATCH_DETAIL
+	                         | G_SIGNAL_MATCH_DATA;
+	GQuark detail;
+	guint id, i;
+
+	for (i = 0; i < LENGTH(signals); i++) {
+		if (!g_signal_parse_name(signals[i], G_OBJECT_TYPE(v), &id,
+		    &detail, FALSE))
+			continue;
+		if (hold) {
+			g_signal_handlers_block_matched(v, match, id, detail,
+			                                NULL, NULL, c);
+		} else {
+			g_signal_handlers_unblock_matched(v, match, id, detail,
+			                                  NULL, NULL, c);
+		}
+	}
+}
+
+/*
+ * Shows the next playlist entry in c by swapping in the view it has been
+ * preloaded in. The view taken out is recycled to preload the entry after.
+ */
+gboolean
+playlistnext(gpointer d)
+{
+	Client *c = (Client *)d;
+	WebKitWebView *v = c->preload;
+	WebKitLoadStatus status = webkit_web_view_get_load_status(v);
+	struct CachePolicy *policy;
+	GtkAllocation a;
+	GSList *overrides;
+
+	c->playpos = (c->playpos + 1) % LENGTH(playlist);
+	stats(c, "playlist: showing %s, %s preloaded", playlist[c->playpos].uri,
+	      status == WEBKIT_LOAD_FINISHED ? "fully" : "partly");
+
+	gtk_widget_get_allocation(c->scroll, &a);
+	g_object_ref(v);
+	g_object_ref(c->view);
+	gtk_container_remove(GTK_CONTAINER(c->preloadwin), GTK_WIDGET(v));
+	gtk_container_remove(GTK_CONTAINER(c->scroll), GTK_WIDGET(c->view));
+	gtk_widget_set_size_request(GTK_WIDGET(v), -1, -1);
+	gtk_container_add(GTK_CONTAINER(c->scroll), GTK_WIDGET(v));
+	gtk_widget_set_size_request(GTK_WIDGET(c->view), a.width, a.height);
+	gtk_container_add(GTK_CONTAINER(c->preloadwin), GTK_WIDGET(c->view));
+
+	playlisthold(c->view, c, TRUE);
+	playlisthold(v, c, FALSE);
+	c->preload = c->view;
+	c->view = v;
+	g_object_unref(c->preload);
+	g_object_unref(v);
+	overrides = c->overrides;
+	c->overrides = c->preloadoverrides;
+	c->preloadoverrides = overrides;
+	policy = c->cachepolicy;
+	c->cachepolicy = c->preloadpolicy;
+	c->preloadpolicy = policy;
+	if (enableinspector)
+		c->inspector = webkit_web_view_get_inspector(v);
+	gtk_widget_grab_focus(GTK_WIDGET(v));
+
+	/* catch up with what the held handlers missed of the page */
+	loadstatus(c, WEBKIT_LOAD_PROVISIONAL);
+	if (status != WEBKIT_LOAD_PROVISIONAL && status != WEBKIT_LOAD_FAILED)
+		loadstatus(c, WEBKIT_LOAD_COMMITTED);
+	if (status == WEBKIT_LOAD_FINISHED)
+		loadstatus(c, WEBKIT_LOAD_FINISHED);
+	titlechange(v, NULL, c);
+	progresschange(v, NULL, c);
+	/* Loaded again with the handlers in place to fall back to the cache */
+	if (status == WEBKIT_LOAD_FAILED)
+		webkit_web_view_load_uri(v, playlist[c->playpos].uri);
+
+	playlistpreload(c);
+	c->playtimer = g_timeout_add_seconds(playlist[c->playpos].seconds,
+	                                     playlistnext, c);
+
+	return FALSE;
+}
+
+/* Loads the entry following the shown one into the hidden view of c. */
+void
+playlistpreload(Client *c)
+{
+	webkit_web_view_load_uri(c->preload,
+	    playlist[(c->playpos + 1) % LENGTH(playlist)].uri);
+}
+
+/*
+ * Shows the first playlist entry in c and preloads the next one in a
+ * second view kept offscreen, held by playlisthold() until it is swapped
+ * in.
+ */
+void
+playliststart(Client *c)
+{
+	WebKitWebInspector *inspector = c->inspector;
+	Arg arg;
+
+	c->playpos = 0;
+	c->preloadwin = gtk_offscreen_window_new();
+	c->preload = newview(c);
+	c->inspector = inspector;
+	playlisthold(c->preload, c, TRUE);
+	gtk_container_add(GTK_CONTAINER(c->preloadwin),
+	                  GTK_WIDGET(c->preload));
+	gtk_widget_show_all(c->preloadwin);
+
+	arg.v = playlist[0].uri;
+	loaduri(c, &arg);
+	playlistpreload(c);
+	c->playtimer = g_timeout_add_seconds(playlist[0].seconds,
+	                                     playlistnext, c);
+}
+
+/*
+ * Replacing the element with a copy of itself makes WebKit ask
+ * createplugin() again, which now lets it through.
+ */
+void
+playplugin(GtkButton *b, Client *c)
+{
+	const char *uri = g_object_get_data(G_OBJECT(b), "uri");
+	char *quoted, *script;
+
+	g_hash_table_replace(c->plugins, g_strdup(uri), GINT_TO_POINTER(1));
+	pluginsavoided--;
+
+	/* plugins are mostly embedded in subframes, like those of ads */
+	quoted = jsquote(uri);
+	script = g_strdup_printf("(function(u) {"
+	         "var e = document.querySelectorAll('embed, object');"
+	         "for (var i = 0; i < e.length; i++) {"
+	         "if ((e[i].src || e[i].data || '') == u)"
+	         "e[i].parentNode.replaceChild(e[i].cloneNode(true), e[i]);"
+	         "}})(%s);", quoted);
+	evalframes(c, script);
+	g_free(script);
+	g_free(quoted);
+}
+
+void
+playvideo(Client *c, const Arg *arg)
+{
+	Arg a;
+
+	updatewinid(c);
+	a = (Arg)PLAY(arg->v ? (char *)arg->v : geturi(c), geturi(c));
+	spawn(c, &a);
+	c->playing = TRUE;
+	stopmedia(c);
+}
+
+/*
+ * Reads the share of time tasks stalled on memory over the last ten seconds
+ * and sheds memory in stages as it crosses pressurestages.
+ */
+gboolean
+pressurepoll(gpointer d)
+{
+	char *buf, *p;
+	double avg10 = 0;
+	int stage;
+
+	if (!g_file_get_contents(pressurefile, &buf, NULL, NULL))
+		return TRUE;
+	if ((p = strstr(buf, "some avg10=")))
+		avg10 = g_ascii_strtod(p + strlen("some avg10="), NULL);
+	g_free(buf);
+
+	for (stage = 0; stage < LENGTH(pressurestages)
+	     && avg10 >= pressurestages[stage]; stage++)
+		;
+
+	if (stage < pressurestage && stage == 0) {
+		stats(NULL, "memory pressure %.2f%%, restoring caches", avg10);
+		webkit_set_cache_model(WEBKIT_CACHE_MODEL_WEB_BROWSER);
+	}
+	while (pressurestage < stage) {
+		stats(NULL, "memory pressure %.2f%%, stage %d", avg10,
+		      pressurestage + 1);
+		shedmemory(++pressurestage);
+	}
+	pressurestage = stage;
+
+	return TRUE;
+}
+
+/*
+ * Loads the pages listed in manifest, one URI per line, into the disk cache
+ * using at most prewarmjobs offscreen views at a time. For each page its
+ * URI, whether it loaded, its bytes, the time it took and how many of its
+ * resources were cached before and after are printed. Returns the number
+ * of pages which failed.
+ */
+int
+prewarm(const char *manifest)
+{
+	WebKitWebSettings *settings;
+	GError *err = NULL;
+	Warm *w;
+	char *data, *ua, **l;
+	guint i, n = 0;
+
+	if (!diskcache)
+		die("The disk cache is disabled\n");
+	if (!g_file_get_contents(manifest, &data, NULL, &err))
+		die("Could not read %s: %s\n", manifest, err->message);
+	warmuris = g_strsplit(data, "\n", -1);
+	g_free(data);
+	for (l = warmuris; *l; l++) {
+		g_strstrip(*l);
+		if (**l && **l != '#')
+			warmuris[n++] = *l;
+		else
+			g_free(*l);
+	}
+	warmuris[n] = NULL;
+
+	if (!(ua = getenv("SURF_USERAGENT")))
+		ua = useragent;
+
+	for (i = 0; i < MIN(prewarmjobs, n); i++) {
+		w = g_new0(Warm, 1);
+		w->win = gtk_offscreen_window_new();
+		w->view = WEBKIT_WEB_VIEW(webkit_web_view_new());
+		settings = webkit_web_view_get_settings(w->view);
+		g_object_set(G_OBJECT(settings), "user-agent", ua, NULL);
+		g_object_set(G_OBJECT(settings), "enable-scripts",
+		             enablescripts, NULL);
+		g_object_set(G_OBJECT(settings), "enable-plugins", FALSE, NULL);
+		g_object_set(G_OBJECT(settings), "auto-load-images", TRUE,
+		             NULL);
+		g_signal_connect(G_OBJECT(w->view),
+		                 "resource-request-starting",
+		                 G_CALLBACK(prewarmrequest), w);
+		g_signal_connect(G_OBJECT(w->view),
+		                 "notify::load-status",
+		                 G_CALLBACK(prewarmstatus), w);
+		gtk_container_add(GTK_CONTAINER(w->win), GTK_WIDGET(w->view));
+		gtk_widget_show_all(w->win);
+		warmjobs++;
+		prewarmload(w);
+	}
+
+	if (warmjobs)
+		gtk_main();
+	g_strfreev(warmuris);
+
+	return warmfailed;
+}
+
+/* Reports the page w loaded and goes on with the next one. */
+gboolean
+prewarmdone(gpointer d)
+{
+	Warm *w = d;
+	WebKitWebDataSource *src;
+	GList *resources, *l;
+	GString *data;
+	const char *uri;
+	gsize bytes = 0;
+	int n = 0, cached = 0;
+
+	/* SoupCache writes bodies asynchronously. */
+	soup_cache_flush(diskcache);
+
+	src = webkit_web_frame_get_data_source(
+	      webkit_web_view_get_main_frame(w->view));
+	resources = g_list_prepend(webkit_web_data_source_get_subresources(src),
+	            webkit_web_data_source_get_main_resource(src));
+	for (l = resources; l; l = l->next) {
+		if (!l->data)
+			continue;
+		uri = webkit_web_resource_get_uri(l->data);
+		if (!g_str_has_prefix(uri, "http://")
+		    && !g_str_has_prefix(uri, "https://"))
+			continue;
+		if ((data = webkit_web_resource_get_data(l->data)))
+			bytes += data->len;
+		n++;
+		cached += incache(uri);
+	}
+	g_list_free(resources);
+
+	printf("%s\t%s\t%lu bytes\t%ld ms\t%d/%d cached before\t"
+	       "%d/%d cached after\n", w->uri, w->result, (unsigned long)bytes,
+	       (long)((g_get_monotonic_time() - w->start) / 1000),
+	       w->hits, w->requests, cached, n);
+	fflush(stdout);
+	if (strcmp(w->result, "ok"))
+		warmfailed++;
+
+	prewarmload(w);
+
+	return FALSE;
+}
+
+/* Gives up on a page which did not finish within prewarmtimeout. */
+gboolean
+prewarmexpire(gpointer d)
+{
+	Warm *w = d;
+
+	w->timer = 0;
+	w->result = "timeout";
+	webkit_web_view_stop_loading(w->view);
+	g_idle_add(prewarmdone, w);
+
+	return FALSE;
+}
+
+/* Starts loading the next page of the manifest in w, if any is left. */
+gboolean
+prewarmload(gpointer d)
+{
+	Warm *w = d;
+
+	if (!warmuris[warmnext]) {
+		gtk_widget_destroy(w->win);
+		g_free(w);
+		if (!--warmjobs)
+			gtk_main_quit();
+		return FALSE;
+	}
+
+	w->uri = warmuris[warmnext++];
+	w->requests = w->hits = 0;
+	w->result = NULL;
+	w->start = g_get_monotonic_time();
+	w->timer = g_timeout_add_seconds(prewarmtimeout, prewarmexpire, w);
+	webkit_web_view_load_uri(w->view, w->uri);
+
+	return FALSE;
+}
+
+void
+prewarmrequest(WebKitWebView *v, WebKitWebFrame *f, WebKitWebResource *r,
+               WebKitNetworkRequest *req, WebKitNetworkResponse *resp,
+               Warm *w)
+{
+	const gchar *uri = webkit_network_request_get_uri(req);
+
+	if (!g_str_has_prefix(uri, "http://")
+	    && !g_str_has_prefix(uri, "https://"))
+		return;
+	w->requests++;
+	w->hits += incache(uri);
+}
+
+void
+prewarmstatus(WebKitWebView *v, GParamSpec *pspec, Warm *w)
+{
+	if (w->result)
+		return;
+
+	switch (webkit_web_view_get_load_status(v)) {
+	case WEBKIT_LOAD_FINISHED:
+		w->result = "ok";
+		break;
+	case WEBKIT_LOAD_FAILED:
+		w->result = "failed";
+		break;
+	default:
+		return;
+	}
+
+	g_source_remove(w->timer);
+	w->timer = 0;
+	g_idle_add(prewarmdone, w);
+}
+
+void
+print(Client *c, const Arg *arg)
 {
 	webkit_web_frame_print(webkit_web_view_get_main_frame(c->view));
 }
 
+void
+releasedeferred(void)
+{
+	SoupSession *s = webkit_get_default_session();
+	GSList *l;
+
+	for (l = deferred; l; l = l->next) {
+		soup_session_unpause_message(s, l->data);
+		g_object_unref(l->data);
+	}
+	g_slist_free(deferred);
+	deferred = NULL;
+}
+
+int
+resourceclass(WebKitWebResource *r)
+{
+	return mimeclass(webkit_web_resource_get_mime_type(r),
+	                 webkit_web_resource_get_uri(r));
+}
+
+/*
+ * Returns the class of a response of type m, by which budgets are counted,
+ * guessing from its uri when the type tells nothing.
+ */
+int
+mimeclass(const char *m, const char *uri)
+{
+	if (!m)
+		return classify(NULL, uri);
+	if (g_str_has_prefix(m, "image/"))
+		return ResImage;
+	if (g_str_has_prefix(m, "video/") || g_str_has_prefix(m, "audio/"))
+		return ResMedia;
+	if (!strcmp(m, "text/css"))
+		return ResStyle;
+	if (strstr(m, "javascript") || strstr(m, "ecmascript"))
+		return ResScript;
+	if (strstr(m, "font"))
+		return ResFont;
+	if (!strcmp(m, "text/html") || strstr(m, "xml"))
+		return ResDoc;
+
+	return classify(NULL, uri);
+}
+
+void
+requestqueued(SoupSession *s, SoupMessage *msg, gpointer d)
+{
+	static const int priorities[ResLast] = {
+		[ResDoc]    = SOUP_MESSAGE_PRIORITY_VERY_HIGH,
+		[ResStyle]  = SOUP_MESSAGE_PRIORITY_HIGH,
+		[ResScript] = SOUP_MESSAGE_PRIORITY_HIGH,
+		[ResFont]   = SOUP_MESSAGE_PRIORITY_NORMAL,
+		[ResImage]  = SOUP_MESSAGE_PRIORITY_LOW,
+		[ResMedia]  = SOUP_MESSAGE_PRIORITY_VERY_LOW,
+		[ResOther]  = SOUP_MESSAGE_PRIORITY_NORMAL,
+	};
+	const char *h;
+	int class, priority;
+
+	if (!(h = soup_message_headers_get_one(msg->request_headers,
+	                                       "X-Surf-Class")))
+		return;
+	class = MIN(MAX(atoi(h), 0), ResLast - 1);
+	priority = priorities[class];
+	/* third party, but neither render blocking nor a font */
+	if (strchr(h, 't') && class != ResFont
+	    && priority <= SOUP_MESSAGE_PRIORITY_NORMAL)
+		priority = SOUP_MESSAGE_PRIORITY_VERY_LOW;
+	soup_message_headers_remove(msg->request_headers, "X-Surf-Class");
+	soup_message_set_priority(msg, priority);
+
+	if (priority >= SOUP_MESSAGE_PRIORITY_HIGH) {
+		g_object_set_data(G_OBJECT(msg), "surf-critical",
+		                  GINT_TO_POINTER(1));
+		critical++;
+	} else if (priority == SOUP_MESSAGE_PRIORITY_VERY_LOW && critical) {
+		/* held back until the critical requests have drained */
+		soup_session_pause_message(s, msg);
+		deferred = g_slist_prepend(deferred, g_object_ref(msg));
+	}
+}
+
+void
+requestunqueued(SoupSession *s, SoupMessage *msg, gpointer d)
+{
+	GSList *l;
+
+	if ((l = g_slist_find(deferred, msg))) {
+		deferred = g_slist_delete_link(deferred, l);
+		g_object_unref(msg);
+	}
+	if (g_object_get_data(G_OBJECT(msg), "surf-critical")
+	    && --critical == 0)
+		releasedeferred();
+}
+
 GdkFilterReturn
 processx(GdkXEvent *e, GdkEvent *event, gpointer d)
 {
@@ -1218,6 +4251,66 @@ progresschange(WebKitWebView *view, GParamSpec *pspec, Client *c)
 	updatetitle(c);
 }
 
+void
+resourcefinished(WebKitWebView *v, WebKitWebFrame *f, WebKitWebResource *r,
+                 Client *c)
+{
+	const char *mime = webkit_web_resource_get_mime_type(r);
+	GString *data;
+
+	if (mime && g_str_has_prefix(mime, "image/")
+	    && (data = webkit_web_resource_get_data(r))) {
+		c->imgbytes += data->len;
+		c->imgcount++;
+	}
+}
+
+/*
+ * Cuts responses of a class whose budget is used up, which the request
+ * did not reveal, before their body is transferred.
+ */
+void
+responsereceived(WebKitWebView *v, WebKitWebFrame *f, WebKitWebResource *r,
+                 WebKitNetworkResponse *resp, Client *c)
+{
+	SoupMessage *msg;
+	Validators *val;
+	const char *uri, *type, *reason, *etag, *modified;
+
+	if (v != c->view || !(msg = webkit_network_response_get_message(resp)))
+		return;
+	uri = webkit_network_response_get_uri(resp);
+
+	/*
+	 * Only copies served past their expiry are revalidated, and only
+	 * when the server gave them something to revalidate against.
+	 */
+	etag = soup_message_headers_get_one(msg->response_headers, "ETag");
+	modified = soup_message_headers_get_one(msg->response_headers,
+	                                        "Last-Modified");
+	if ((etag || modified) && servedstale(msg)) {
+		val = g_new(Validators, 1);
+		val->etag = g_strdup(etag);
+		val->modified = g_strdup(modified);
+		g_hash_table_replace(c->stale, g_strdup(uri), val);
+	}
+
+	if (!c->budget)
+		return;
+	if (f == webkit_web_view_get_main_frame(v)
+	    && classify(f, uri) == ResDoc)
+		return;
+
+	type = soup_message_headers_get_content_type(msg->response_headers,
+	                                             NULL);
+	if ((reason = budgetexceeded(c, mimeclass(type, uri)))) {
+		fprintf(stderr, "surf: budget: cut %s (%s)\n", uri, reason);
+		c->cut++;
+		soup_session_cancel_message(webkit_get_default_session(), msg,
+		                            SOUP_STATUS_CANCELLED);
+	}
+}
+
 void
 linkopen(Client *c, const Arg *arg)
 {
@@ -1230,6 +4323,23 @@ linkopenembed(Client *c, const Arg *arg)
 	newwindow(NULL, arg, 0);
 }
 
+/*
+ * Reloads the page with every request answered by the disk cache, however
+ * stale, so a setting that needs a new document does not cost a round trip
+ * per resource. Without a disk cache it is a normal reload.
+ */
+void
+refresh(Client *c)
+{
+	Arg a = { .b = FALSE };
+
+	if (diskcache) {
+		c->cacheonly = TRUE;
+		stats(c, "reloading from the disk cache only");
+	}
+	reload(c, &a);
+}
+
 void
 reload(Client *c, const Arg *arg)
 {
@@ -1240,6 +4350,260 @@ reload(Client *c, const Arg *arg)
 		webkit_web_view_reload(c->view);
 }
 
+/*
+ * Asks the network in the background whether the resources of c's page that
+ * were served stale are still current, with conditional requests carrying
+ * the validators of the copies served, so that the disk cache is updated.
+ */
+void
+revalidate(Client *c)
+{
+	GHashTableIter iter;
+	gpointer k, d;
+	Validators *val;
+	SoupMessage *msg;
+	gint64 now = g_get_monotonic_time(), *last;
+	char *ua;
+	int n = 0;
+
+	g_hash_table_foreach_remove(revalidated, revalidatedold, &now);
+	if (!(ua = getenv("SURF_USERAGENT")))
+		ua = useragent;
+
+	g_hash_table_iter_init(&iter, c->stale);
+	while (g_hash_table_iter_next(&iter, &k, &d)) {
+		val = (Validators *)d;
+		if (((last = g_hash_table_lookup(revalidated, k))
+		    && now - *last < REVALIDATEAFTER * G_USEC_PER_SEC)
+		    || !(msg = soup_message_new("GET", k)))
+			continue;
+
+		last = g_new(gint64, 1);
+		*last = now;
+		g_hash_table_replace(revalidated, g_strdup(k), last);
+		if (val->etag)
+			soup_message_headers_append(msg->request_headers,
+			                            "If-None-Match", val->etag);
+		if (val->modified)
+			soup_message_headers_append(msg->request_headers,
+			                            "If-Modified-Since",
+			                            val->modified);
+		soup_message_headers_replace(msg->request_headers,
+		                             "User-Agent", ua);
+		soup_message_set_priority(msg, SOUP_MESSAGE_PRIORITY_VERY_LOW);
+		soup_session_queue_message(webkit_get_default_session(), msg,
+		                           NULL, NULL);
+		n++;
+	}
+	g_hash_table_remove_all(c->stale);
+
+	if (n)
+		stats(c, "revalidating %d resources in the background", n);
+}
+
+/* Drops the revalidation times that no longer hold anything back. */
+gboolean
+revalidatedold(gpointer k, gpointer v, gpointer d)
+{
+	return *(gint64 *)d - *(gint64 *)v >= REVALIDATEAFTER * G_USEC_PER_SEC;
+}
+
+/*
+ * Whether msg was let to take a stale copy from the disk cache and got one,
+ * that is a response older than the lifetime its headers gave it. Responses
+ * without an explicit lifetime are left to the cache's own heuristics.
+ */
+gboolean
+servedstale(SoupMessage *msg)
+{
+	SoupMessageHeaders *h = msg->response_headers;
+	GHashTable *params;
+	SoupDate *d;
+	const char *v;
+	time_t date;
+	long age = 0, life = -1;
+
+	if (!(v = soup_message_headers_get_list(msg->request_headers,
+	    "Cache-Control")) || !strstr(v, "max-stale")
+	    || !(v = soup_message_headers_get_one(h, "Date"))
+	    || !(d = soup_date_new_from_string(v)))
+		return FALSE;
+	date = soup_date_to_time_t(d);
+	soup_date_free(d);
+
+	if ((v = soup_message_headers_get_one(h, "Age")))
+		age = atol(v);
+	age += MAX(time(NULL) - date, 0);
+	if ((v = soup_message_headers_get_list(h, "Cache-Control"))) {
+		params = soup_header_parse_param_list(v);
+		if ((v = g_hash_table_lookup(params, "max-age")))
+			life = atol(v);
+		soup_header_free_param_list(params);
+	}
+	if (life < 0 && (v = soup_message_headers_get_one(h, "Expires"))
+	    && (d = soup_date_new_from_string(v))) {
+		life = soup_date_to_time_t(d) - date;
+		soup_date_free(d);
+	}
+
+	return life >= 0 && age > life;
+}
+
+/* Rebuilds the history of c's view from s and loads its current page. */
+void
+restorestate(Client *c, PageState *s)
+{
+	WebKitWebBackForwardList *list;
+	WebKitWebHistoryItem *item;
+	int i;
+
+	if (!s->n)
+		return;
+
+	list = webkit_web_view_get_back_forward_list(c->view);
+	for (i = 0; i < s->n; i++) {
+		item = webkit_web_history_item_new_with_data(s->uris[i],
+		       s->titles[i]);
+		webkit_web_back_forward_list_add_item(list, item);
+	}
+	webkit_web_view_go_to_back_forward_item(c->view,
+	    webkit_web_back_forward_list_get_nth_item(list,
+	    s->current - (s->n - 1)));
+
+	if (s->zoom)
+		webkit_web_view_set_zoom_level(c->view, s->zoom);
+	c->restorescroll = TRUE;
+}
+
+/*
+ * Loads the next restored window that is shown, unless one is still being
+ * loaded. Windows are not mapped yet when the session is read, and hidden
+ * ones, like the other tabs of tabbed, wait until setvisible() shows them,
+ * so restarted processes do not all load their pages at once.
+ */
+void
+restorenext(void)
+{
+	Client *c, *next = NULL;
+
+	for (c = clients; c; c = c->next) {
+		if (c->restoring)
+			return;
+		if (c->pending && c->visible && !next)
+			next = c;
+	}
+	if (next)
+		restorepending(next);
+}
+
+void
+restorepending(Client *c)
+{
+	gint64 now = g_get_monotonic_time();
+
+	c->pending = FALSE;
+	restorestate(c, &c->state);
+	stats(c, "restored after %ld ms", (long)(now - starttime) / 1000);
+	/* restorenext() goes on once the page has loaded */
+	if (!(c->restoring = c->state.n > 0))
+		restorenext();
+}
+
+void
+resumeclient(Client *c)
+{
+	long rss = getrss();
+
+	if (!c->suspended)
+		return;
+
+	if (c->placeholder) {
+		gtk_widget_destroy(c->placeholder);
+		c->placeholder = NULL;
+	}
+	gtk_widget_show(c->scroll);
+	c->suspended = FALSE;
+
+	restorestate(c, &c->state);
+	resumes++;
+	stats(c, "resumed (%u of %u), rss %ld -> %ld KiB", resumes, suspends,
+	      rss, getrss());
+}
+
+/* Writes the windows of this process to its file in sessiondir. */
+void
+savesession(void)
+{
+	GKeyFile *kf;
+	Client *c;
+	char *group, *data;
+	int i = 0;
+
+	if (!sessionfile)
+		return;
+
+	kf = g_key_file_new();
+	for (c = clients; c; c = c->next) {
+		/* source windows are rebuilt from their page, not reloaded */
+		if (c->issource)
+			continue;
+		if (!c->suspended && !c->pending)
+			savestate(c, &c->state);
+		if (!c->state.n)
+			continue;
+		group = g_strdup_printf("window %d", i++);
+		g_key_file_set_string_list(kf, group, "uris",
+		    (const gchar * const *)c->state.uris, c->state.n);
+		g_key_file_set_string_list(kf, group, "titles",
+		    (const gchar * const *)c->state.titles, c->state.n);
+		g_key_file_set_integer(kf, group, "current", c->state.current);
+		g_key_file_set_double(kf, group, "x", c->state.x);
+		g_key_file_set_double(kf, group, "y", c->state.y);
+		g_key_file_set_double(kf, group, "zoom", c->state.zoom);
+		g_free(group);
+	}
+
+	data = g_key_file_to_data(kf, NULL, NULL);
+	g_file_set_contents(sessionfile, data, -1, NULL);
+	g_free(data);
+	g_key_file_free(kf);
+}
+
+void
+savestate(Client *c, PageState *s)
+{
+	WebKitWebBackForwardList *list;
+	WebKitWebHistoryItem *item;
+	GtkAdjustment *a;
+	int i, back, forward;
+
+	list = webkit_web_view_get_back_forward_list(c->view);
+	back = webkit_web_back_forward_list_get_back_length(list);
+	forward = webkit_web_back_forward_list_get_forward_length(list);
+
+	freestate(s);
+	s->uris = g_new0(char *, back + forward + 2);
+	s->titles = g_new0(char *, back + forward + 2);
+	for (i = -back; i <= forward; i++) {
+		if (!(item = webkit_web_back_forward_list_get_nth_item(list,
+		    i)))
+			continue;
+		s->uris[s->n] = g_strdup(webkit_web_history_item_get_uri(item));
+		s->titles[s->n] = g_strdup(
+		    webkit_web_history_item_get_title(item) ?
+		    webkit_web_history_item_get_title(item) : "");
+		if (i == 0)
+			s->current = s->n;
+		s->n++;
+	}
+
+	a = gtk_scrolled_window_get_hadjustment(GTK_SCROLLED_WINDOW(c->scroll));
+	s->x = gtk_adjustment_get_value(a);
+	a = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(c->scroll));
+	s->y = gtk_adjustment_get_value(a);
+	s->zoom = webkit_web_view_get_zoom_level(c->view);
+}
+
 void
 scroll_h(Client *c, const Arg *arg)
 {
@@ -1277,6 +4641,130 @@ scroll(GtkAdjustment *a, const Arg *arg)
 	gtk_adjustment_set_value(a, v);
 }
 
+/* Writes a chunk of a range response at its place in the partial file. */
+void
+segmentchunk(SoupMessage *msg, SoupBuffer *chunk, Segment *s)
+{
+	Transfer *t = s->t;
+	gint64 now;
+	gsize len;
+
+	if (t->stopped || msg->status_code != SOUP_STATUS_PARTIAL_CONTENT)
+		return;
+
+	len = MIN(chunk->length, s->end + 1 - s->pos);
+	if (pwrite(t->fd, chunk->data, len, s->pos) != (ssize_t)len) {
+		soup_session_cancel_message(webkit_get_default_session(), msg,
+		                            SOUP_STATUS_IO_ERROR);
+		return;
+	}
+	s->pos += len;
+	s->retries = 0;
+
+	if ((now = g_get_monotonic_time()) - t->saved > G_USEC_PER_SEC) {
+		t->saved = now;
+		transfersave(t);
+		updatetitle(t->c);
+	}
+}
+
+void
+segmentdone(SoupSession *session, SoupMessage *msg, gpointer d)
+{
+	Segment *s = (Segment *)d;
+	Transfer *t = s->t;
+	int i;
+
+	s->msg = NULL;
+	if (!--t->active && t->stopped) {
+		transferfree(t);
+		return;
+	}
+	if (t->stopped)
+		return;
+
+	if (s->pos > s->end) {
+		for (i = 0; i < t->nseg && t->seg[i].pos > t->seg[i].end; i++)
+			;
+		if (i == t->nseg)
+			transferfinish(t);
+	} else if (msg->status_code == SOUP_STATUS_PRECONDITION_FAILED) {
+		transferfail(t, "changed on the server", TRUE);
+	} else if (s->retries < downloadretries) {
+		s->retry = g_timeout_add_seconds(1 << s->retries++,
+		                                 segmentretry, s);
+	} else {
+		transferfail(t, msg->reason_phrase, FALSE);
+	}
+}
+
+gboolean
+segmentfetch(Segment *s)
+{
+	Transfer *t = s->t;
+	char *ua;
+
+	s->retry = 0;
+	if (!(s->msg = soup_message_new("GET", t->uri)))
+		return FALSE;
+	soup_message_headers_set_range(s->msg->request_headers, s->pos,
+	                               s->end);
+	if (t->etag) {
+		soup_message_headers_append(s->msg->request_headers,
+		                            "If-Range", t->etag);
+	}
+	if (t->referer) {
+		soup_message_headers_append(s->msg->request_headers,
+		                            "Referer", t->referer);
+	}
+	if (!(ua = getenv("SURF_USERAGENT")))
+		ua = useragent;
+	soup_message_headers_replace(s->msg->request_headers, "User-Agent",
+	                             ua);
+	soup_message_body_set_accumulate(s->msg->response_body, FALSE);
+	g_signal_connect(G_OBJECT(s->msg), "got-headers",
+	                 G_CALLBACK(segmentheaders), s);
+	g_signal_connect(G_OBJECT(s->msg), "got-chunk",
+	                 G_CALLBACK(segmentchunk), s);
+
+	t->active++;
+	soup_session_queue_message(webkit_get_default_session(), s->msg,
+	                           segmentdone, s);
+
+	return TRUE;
+}
+
+/*
+ * Accepts only the requested range of the file that was started, anything
+ * else means the file changed on the server.
+ */
+void
+segmentheaders(SoupMessage *msg, Segment *s)
+{
+	goffset start, end, total;
+
+	if (msg->status_code == SOUP_STATUS_PARTIAL_CONTENT
+	    && soup_message_headers_get_content_range(msg->response_headers,
+	    &start, &end, &total) && start == s->pos
+	    && total == s->t->total)
+		return;
+
+	if (SOUP_STATUS_IS_SUCCESSFUL(msg->status_code)) {
+		soup_session_cancel_message(webkit_get_default_session(), msg,
+		                            SOUP_STATUS_PRECONDITION_FAILED);
+	}
+}
+
+gboolean
+segmentretry(gpointer d)
+{
+	Segment *s = (Segment *)d;
+
+	if (!segmentfetch(s))
+		transferfail(s->t, "invalid URI", TRUE);
+	return FALSE;
+}
+
 void
 setatom(Client *c, int a, const char *v)
 {
@@ -1286,16 +4774,55 @@ setatom(Client *c, int a, const char *v)
 	                (unsigned char *)v, strlen(v) + 1);
 }
 
+void
+setvisible(Client *c, gboolean visible)
+{
+	gint64 now = g_get_monotonic_time(), cpu = cputime();
+
+	if (c->visible == visible)
+		return;
+
+	if (c->since && now > c->since) {
+		stats(c, "%s for %ld s, %.1f%% cpu",
+		      c->visible ? "visible" : "hidden",
+		      (long)(now - c->since) / G_USEC_PER_SEC,
+		      100.0 * (cpu - c->cpu) / (now - c->since));
+	}
+	c->visible = visible;
+	c->since = now;
+	c->cpu = cpu;
+
+	if (c->suspendtimer) {
+		g_source_remove(c->suspendtimer);
+		c->suspendtimer = 0;
+	}
+	if (visible && c->pending)
+		restorenext();
+	else if (visible)
+		resumeclient(c);
+	else if (gcinterval)
+		collectgarbage(c, "hidden");
+
+	/* every frame got the shim from windowobjectcleared() */
+	if (throttlehidden)
+		evalframes(c, visible ? "window.__surfthrottle && "
+		                        "__surfthrottle(false);"
+		                      : "window.__surfthrottle && "
+		                        "__surfthrottle(true);");
+}
+
 void
 setup(void)
 {
 	int i;
 	char *proxy, *new_proxy;
-	char *styledirfile, *stylepath;
+	char *styledirfile, *stylepath, *cg, *p;
 	SoupURI *puri;
 	SoupSession *s;
 	GError *error = NULL;
 
+	starttime = g_get_monotonic_time();
+
 	/* clean up any zombies immediately */
 	sigchld(0);
 	gtk_init(NULL, NULL);
@@ -1306,11 +4833,16 @@ setup(void)
 	atoms[AtomFind] = XInternAtom(dpy, "_SURF_FIND", False);
 	atoms[AtomGo] = XInternAtom(dpy, "_SURF_GO", False);
 	atoms[AtomUri] = XInternAtom(dpy, "_SURF_URI", False);
+	atoms[AtomHeap] = XInternAtom(dpy, "_SURF_HEAP", False);
 
 	/* dirs and files */
 	cookiefile = buildfile(cookiefile);
 	scriptfile = buildfile(scriptfile);
 	cachefolder = buildpath(cachefolder);
+	assetdir = buildpath(assetdir);
+	archivedir = buildpath(archivedir);
+	downloaddir = buildpath(downloaddir);
+	loadassets();
 	if (stylefile == NULL) {
 		styledir = buildpath(styledir);
 		for (i = 0; i < LENGTH(styles); i++) {
@@ -1336,6 +4868,100 @@ setup(void)
 		g_free(stylepath);
 	}
 
+	for (i = 0; i < LENGTH(budgets); i++) {
+		if (regcomp(&(budgets[i].re), budgets[i].regex,
+		    REG_EXTENDED)) {
+			fprintf(stderr, "Could not compile regex: %s\n",
+			        budgets[i].regex);
+			budgets[i].regex = NULL;
+		}
+	}
+
+	for (i = 0; i < LENGTH(cachepolicies); i++) {
+		if (regcomp(&(cachepolicies[i].re), cachepolicies[i].regex,
+		    REG_EXTENDED | REG_NOSUB)) {
+			fprintf(stderr, "Could not compile regex: %s\n",
+			        cachepolicies[i].regex);
+			cachepolicies[i].regex = NULL;
+		}
+	}
+	revalidated = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	                                    g_free);
+
+	if (pluginsallowed && regcomp(&pluginre, pluginsallowed,
+	    REG_EXTENDED | REG_NOSUB)) {
+		fprintf(stderr, "Could not compile regex: %s\n",
+		        pluginsallowed);
+		pluginsallowed = NULL;
+	}
+
+	if (videosites && regcomp(&videore, videosites,
+	    REG_EXTENDED | REG_NOSUB)) {
+		fprintf(stderr, "Could not compile regex: %s\n", videosites);
+		videosites = NULL;
+	}
+
+	if (gcinterval)
+		g_timeout_add_seconds(gcinterval, gcidle, NULL);
+	if (triminterval)
+		g_timeout_add_seconds(triminterval, trimtimer, NULL);
+
+	/* history */
+	if (historyfile) {
+		historyfile = buildfile(historyfile);
+		historyindex = g_strconcat(historyfile, ".index", NULL);
+		historyprefix = g_strconcat(historyfile, ".prefix", NULL);
+		if ((historyfd = open(historyfile, O_WRONLY | O_APPEND
+		    | O_CREAT, 0600)) < 0)
+			perror("surf: history");
+		else
+			g_timeout_add_seconds(HISTORYREFOLD, historytimer,
+			                      NULL);
+	}
+
+	/* session */
+	if (restoresession && sessiondir) {
+		sessiondir = buildpath(sessiondir);
+		sessionfile = g_strdup_printf("%s/%d", sessiondir, getpid());
+	}
+
+	/* memory budget shared with the other surf processes */
+	if (memorybudget) {
+		instancefile = buildfile(instancefile);
+		joininstances();
+	}
+
+	/* memory pressure, from the cgroup surf runs in or the whole system */
+	if (pressureinterval) {
+		if (g_file_get_contents("/proc/self/cgroup", &cg, NULL, NULL)) {
+			if ((p = strstr(cg, "0::/"))) {
+				p[strcspn(p, "\n")] = '\0';
+				pressurefile = g_strconcat("/sys/fs/cgroup",
+				               p + 3, "/memory.pressure", NULL);
+				if (!g_file_test(pressurefile,
+				    G_FILE_TEST_EXISTS)) {
+					g_free(pressurefile);
+					pressurefile = NULL;
+				}
+			}
+			g_free(cg);
+		}
+		if (!pressurefile && g_file_test("/proc/pressure/memory",
+		    G_FILE_TEST_EXISTS))
+			pressurefile = g_strdup("/proc/pressure/memory");
+		if (pressurefile)
+			g_timeout_add_seconds(pressureinterval, pressurepoll,
+			                      NULL);
+	}
+
+	/* site settings, indexed by host suffix */
+	sitehosts = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; i < LENGTH(sitesettings); i++) {
+		g_hash_table_replace(sitehosts, sitesettings[i].host,
+		                     g_slist_append(g_hash_table_lookup(sitehosts,
+		                     sitesettings[i].host), &sitesettings[i]));
+	}
+
 	/* request handler */
 	s = webkit_get_default_session();
 
@@ -1353,6 +4979,18 @@ setup(void)
 		soup_session_add_feature(s, SOUP_SESSION_FEATURE(diskcache));
 	}
 
+	/* local asset store */
+	if (assets)
+		soup_session_add_feature_by_type(s, ASSETREQUEST_TYPE);
+
+	/* request scheduler */
+	if (enablescheduler) {
+		g_signal_connect(G_OBJECT(s), "request-queued",
+		                 G_CALLBACK(requestqueued), NULL);
+		g_signal_connect(G_OBJECT(s), "request-unqueued",
+		                 G_CALLBACK(requestunqueued), NULL);
+	}
+
 	/* ssl */
 	tlsdb = g_tls_file_database_new(cafile, &error);
 
@@ -1380,6 +5018,36 @@ setup(void)
 	}
 }
 
+/*
+ * Compares the registrable domains of the hosts of both URIs, as known to
+ * the public suffix list, so a.example.co.uk and b.other.co.uk differ.
+ * Hosts without one, like IP addresses, are compared as a whole.
+ */
+gboolean
+samesite(const char *a, const char *b)
+{
+	SoupURI *ua, *ub;
+	const char *ha, *hb, *da, *db;
+	gboolean same = FALSE;
+
+	ua = soup_uri_new(a);
+	ub = soup_uri_new(b);
+	if (ua && ub && (ha = soup_uri_get_host(ua))
+	    && (hb = soup_uri_get_host(ub))) {
+		if (!(da = soup_tld_get_base_domain(ha, NULL)))
+			da = ha;
+		if (!(db = soup_tld_get_base_domain(hb, NULL)))
+			db = hb;
+		same = !g_ascii_strcasecmp(da, db);
+	}
+	if (ua)
+		soup_uri_free(ua);
+	if (ub)
+		soup_uri_free(ub);
+
+	return same;
+}
+
 void
 sigchld(int unused)
 {
@@ -1392,11 +5060,131 @@ void
 source(Client *c, const Arg *arg)
 {
 	Arg a = { .b = FALSE };
+	WebKitWebDataSource *src;
+	GString *data;
+	Source *sc;
 	gboolean s;
 
-	s = webkit_web_view_get_view_source_mode(c->view);
-	webkit_web_view_set_view_source_mode(c->view, !s);
-	reload(c, &a);
+	/* a source window just goes away, its page is still there */
+	if (c->issource) {
+		gtk_widget_destroy(c->win);
+		return;
+	}
+
+	src = webkit_web_frame_get_data_source(
+	      webkit_web_view_get_main_frame(c->view));
+	if (!(data = webkit_web_data_source_get_data(src))) {
+		s = webkit_web_view_get_view_source_mode(c->view);
+		webkit_web_view_set_view_source_mode(c->view, !s);
+		reload(c, &a);
+		return;
+	}
+
+	/*
+	 * Render the bytes WebKit already has in a new window, escaping and
+	 * highlighting them in another thread.
+	 */
+	sc = g_new0(Source, 1);
+	sc->c = newclient();
+	sc->c->issource = TRUE;
+	sc->uri = g_strdup(geturi(c));
+	sc->encoding = g_strdup(webkit_web_data_source_get_encoding(src));
+	sc->data = g_string_new_len(data->str, data->len);
+	g_thread_unref(g_thread_new("source", sourcehighlight, sc));
+}
+
+/* Turns the page source into HTML, with tags and comments highlighted. */
+gpointer
+sourcehighlight(gpointer d)
+{
+	Source *sc = (Source *)d;
+	char *text, *title, *p, *v = NULL, q = 0;
+	enum { Text, Tag, Value, Comment } state = Text;
+
+	if (!sc->encoding || !g_ascii_strcasecmp(sc->encoding, "UTF-8")
+	    || !(text = g_convert(sc->data->str, sc->data->len, "UTF-8",
+	    sc->encoding, NULL, NULL, NULL)))
+		text = g_strndup(sc->data->str, sc->data->len);
+
+	title = g_markup_escape_text(sc->uri, -1);
+	sc->html = g_string_sized_new(sc->data->len * 3 / 2);
+	g_string_append_printf(sc->html, "<!DOCTYPE html><html><head>"
+	    "<meta charset=\"UTF-8\"><title>view-source:%s</title><style>"
+	    "pre { white-space: pre-wrap; word-wrap: break-word; }"
+	    ".t { color: #881280; } .v { color: #1a1aa6; }"
+	    ".c { color: #236e25; }</style></head><body><pre>", title);
+	g_free(title);
+
+	for (p = text; *p; p++) {
+		if (highlightsource) {
+			if (state == Text && !strncmp(p, "<!--", 4)) {
+				g_string_append(sc->html, "<span class=\"c\">");
+				state = Comment;
+			} else if (state == Text && *p == '<') {
+				g_string_append(sc->html, "<span class=\"t\">");
+				state = Tag;
+			} else if (state == Tag && (*p == '"' || *p == '\'')) {
+				g_string_append(sc->html, "<span class=\"v\">");
+				q = *p;
+				v = p;
+				state = Value;
+			}
+		}
+
+		switch (*p) {
+		case '<':
+			g_string_append(sc->html, "&lt;");
+			break;
+		case '>':
+			g_string_append(sc->html, "&gt;");
+			break;
+		case '&':
+			g_string_append(sc->html, "&amp;");
+			break;
+		case '"':
+			g_string_append(sc->html, "&quot;");
+			break;
+		default:
+			g_string_append_c(sc->html, *p);
+			break;
+		}
+
+		if (state == Value && *p == q && p != v) {
+			g_string_append(sc->html, "</span>");
+			state = Tag;
+		} else if ((state == Tag && *p == '>') || (state == Comment
+		    && *p == '>' && p - text >= 2 && !strncmp(p - 2, "-->", 3))) {
+			g_string_append(sc->html, "</span>");
+			state = Text;
+		}
+	}
+	g_string_append(sc->html, "</pre></body></html>");
+	g_free(text);
+
+	g_idle_add(sourceshow, sc);
+	return NULL;
+}
+
+gboolean
+sourceshow(gpointer d)
+{
+	Source *sc = (Source *)d;
+	Client *c;
+
+	for (c = clients; c && c != sc->c; c = c->next)
+		;
+	if (c) {
+		webkit_web_view_load_string(c->view, sc->html->str, "text/html",
+		                            "UTF-8", "about:blank");
+	}
+
+	g_string_free(sc->html, TRUE);
+	g_string_free(sc->data, TRUE);
+	g_free(sc->encoding);
+	g_free(sc->uri);
+	g_free(sc);
+
+	return FALSE;
 }
 
 void
@@ -1413,6 +5201,69 @@ spawn(Client *c, const Arg *arg)
 	}
 }
 
+/* Gives back memory at the given stage of pressurepoll(). */
+void
+shedmemory(int stage)
+{
+	Client *c;
+	long rss = getrss();
+
+	switch (stage) {
+	case 1:
+		/* a smaller memory cache, back/forward pages are kept */
+		webkit_set_cache_model(WEBKIT_CACHE_MODEL_DOCUMENT_BROWSER);
+		stats(NULL, "shrunk memory cache, reclaimed %ld KiB",
+		      rss - getrss());
+		break;
+	case 2:
+		webkit_set_cache_model(WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER);
+		stats(NULL, "dropped memory cache, reclaimed %ld KiB",
+		      rss - getrss());
+		break;
+	case 3:
+		for (c = clients; c; c = c->next)
+			collectgarbage(c, "pressure");
+		stats(NULL, "collected js garbage, reclaimed %ld KiB",
+		      rss - getrss());
+		break;
+	case 4:
+		for (c = clients; c; c = c->next)
+			droppagecache(c);
+		stats(NULL, "dropped page cache, reclaimed %ld KiB",
+		      rss - getrss());
+		break;
+	case 5:
+		for (c = clients; c; c = c->next) {
+			if (c->visible)
+				continue;
+			/* suspended now, so the timer must not fire later */
+			if (c->suspendtimer) {
+				g_source_remove(c->suspendtimer);
+				c->suspendtimer = 0;
+			}
+			suspendclient(c);
+		}
+		stats(NULL, "suspended hidden windows, reclaimed %ld KiB",
+		      rss - getrss());
+		break;
+	}
+}
+
+void
+stats(Client *c, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!enablestats)
+		return;
+
+	fprintf(stderr, "surf: %s: ", c ? geturi(c) : "-");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
 void
 eval(Client *c, const Arg *arg)
 {
@@ -1421,10 +5272,350 @@ eval(Client *c, const Arg *arg)
 	           ((char **)arg->v)[0], "");
 }
 
+/*
+ * Unloads all media elements of the page and its frames, so they stop
+ * decoding and downloading.
+ */
+void
+stopmedia(Client *c)
+{
+	evalframes(c, "(function() {"
+	              "var m = document.querySelectorAll('video, audio');"
+	              "for (var i = 0; i < m.length; i++) {"
+	              "m[i].pause(); m[i].removeAttribute('src'); m[i].load();"
+	              "}"
+	              "})();");
+}
+
+/*
+ * Replaces the web view of a client unmapped for suspendtimeout seconds by an
+ * empty one and shows its last snapshot until it is resumed.
+ */
+gboolean
+suspendclient(gpointer d)
+{
+	Client *c = (Client *)d;
+	long rss = getrss();
+
+	c->suspendtimer = 0;
+	if (c->suspended || c->pending || c->visible)
+		return FALSE;
+
+	if (c->isinspecting)
+		webkit_web_inspector_close(c->inspector);
+	savestate(c, &c->state);
+	if (!c->state.n)
+		return FALSE;
+
+	webkit_web_view_stop_loading(c->view);
+	gtk_widget_destroy(GTK_WIDGET(c->view));
+	c->view = newview(c);
+	gtk_container_add(GTK_CONTAINER(c->scroll), GTK_WIDGET(c->view));
+	gtk_widget_show(GTK_WIDGET(c->view));
+	gtk_widget_hide(c->scroll);
+
+	if (c->snapshot) {
+		c->placeholder = gtk_image_new_from_pixmap(c->snapshot, NULL);
+		gtk_box_pack_start(GTK_BOX(c->vbox), c->placeholder, TRUE,
+		                   TRUE, 0);
+		gtk_widget_show(c->placeholder);
+	}
+	c->suspended = TRUE;
+
+	suspends++;
+	stats(c, "suspended (%u of %u), rss %ld -> %ld KiB", suspends,
+	      suspends + resumes, rss, getrss());
+
+	return FALSE;
+}
+
 void
 stop(Client *c, const Arg *arg)
 {
 	webkit_web_view_stop_loading(c->view);
+	g_slist_foreach(c->downloads, (GFunc)webkit_download_cancel, NULL);
+	while (c->transfers)
+		transferfail(c->transfers->data, "cancelled", TRUE);
+}
+
+void
+takesnapshot(Client *c)
+{
+	GdkPixmap *p;
+
+	if (!suspendtimeout || c->suspended
+	    || !(p = gtk_widget_get_snapshot(GTK_WIDGET(c->view), NULL)))
+		return;
+
+	if (c->snapshot)
+		g_object_unref(c->snapshot);
+	c->snapshot = p;
+}
+
+/* Hands memory freed by the allocator back to the system. */
+gboolean
+trimmemory(gpointer d)
+{
+	long rss = getrss();
+
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+	stats(NULL, "trimmed heap (%s), rss %ld -> %ld KiB",
+	      d ? (char *)d : "timer", rss, getrss());
+
+	return FALSE;
+}
+
+gboolean
+trimtimer(gpointer d)
+{
+	trimmemory(NULL);
+	return TRUE;
+}
+
+void
+transferfail(Transfer *t, const char *why, gboolean discard)
+{
+	fprintf(stderr, "surf: download of %s failed: %s%s\n", t->uri, why,
+	        discard ? "" : ", will resume on next start");
+	if (discard) {
+		g_remove(t->part);
+		g_remove(t->state);
+	}
+	if (t->c) {
+		t->c->transfers = g_slist_remove(t->c->transfers, t);
+		updatetitle(t->c);
+	}
+	transferstop(t);
+}
+
+/*
+ * Every segment has written up to its end, so the partial file is complete.
+ * Requests that are still in flight free t once they are done.
+ */
+void
+transferfinish(Transfer *t)
+{
+	gdouble secs = (g_get_monotonic_time() - t->started)
+	               / (gdouble)G_USEC_PER_SEC;
+
+	if (rename(t->part, t->path) < 0) {
+		transferfail(t, strerror(errno), FALSE);
+		return;
+	}
+	g_remove(t->state);
+	fprintf(stderr, "surf: downloaded %s\n", t->path);
+	stats(t->c, "download of %ld bytes in %d parts after %.1f s, "
+	      "%.0f KiB/s", (long)t->total, t->nseg, secs,
+	      t->total / 1024.0 / MAX(secs, 0.001));
+
+	t->c->transfers = g_slist_remove(t->c->transfers, t);
+	updatetitle(t->c);
+	t->stopped = TRUE;
+	if (!t->active)
+		transferfree(t);
+}
+
+void
+transferfree(Transfer *t)
+{
+	close(t->fd);
+	g_free(t->uri);
+	g_free(t->referer);
+	g_free(t->etag);
+	g_free(t->path);
+	g_free(t->part);
+	g_free(t->state);
+	g_free(t);
+}
+
+/*
+ * Opens and locks the partial file of a segmented download to path, so no
+ * other surf process works on it.
+ */
+Transfer *
+transfernew(Client *c, const char *path)
+{
+	Transfer *t = g_new0(Transfer, 1);
+	int i;
+
+	t->path = g_strdup(path);
+	t->part = g_strconcat(path, ".surfpart", NULL);
+	t->state = g_strconcat(t->part, ".state", NULL);
+	if ((t->fd = open(t->part, O_RDWR | O_CREAT, 0600)) < 0
+	    || flock(t->fd, LOCK_EX | LOCK_NB) < 0) {
+		transferfree(t);
+		return NULL;
+	}
+	for (i = 0; i < MAXSEGMENTS; i++)
+		t->seg[i].t = t;
+	t->c = c;
+
+	return t;
+}
+
+/* Returns a path in downloaddir for name that is not taken yet. */
+char *
+transferpath(const char *name)
+{
+	char *path, *part;
+	int i;
+
+	path = g_build_filename(downloaddir, name, NULL);
+	for (i = 1; ; i++) {
+		part = g_strconcat(path, ".surfpart", NULL);
+		if (!g_file_test(path, G_FILE_TEST_EXISTS)
+		    && !g_file_test(part, G_FILE_TEST_EXISTS))
+			break;
+		g_free(part);
+		g_free(path);
+		path = g_strdup_printf("%s/%s.%d", downloaddir, name, i);
+	}
+	g_free(part);
+
+	return path;
+}
+
+/* Picks up the segmented downloads left in downloaddir. */
+void
+transferresume(Client *c)
+{
+	GDir *dir;
+	GKeyFile *kf;
+	Transfer *t;
+	const char *name;
+	char *state, *path, *seg, *key, *p;
+	int i;
+
+	if (!(dir = g_dir_open(downloaddir, 0, NULL)))
+		return;
+
+	while ((name = g_dir_read_name(dir))) {
+		if (!g_str_has_suffix(name, ".surfpart.state"))
+			continue;
+		state = g_build_filename(downloaddir, name, NULL);
+		path = g_strndup(state, strlen(state)
+		                 - strlen(".surfpart.state"));
+		kf = g_key_file_new();
+		if (!g_key_file_load_from_file(kf, state, G_KEY_FILE_NONE,
+		    NULL) || !(t = transfernew(c, path))) {
+			g_key_file_free(kf);
+			g_free(path);
+			g_free(state);
+			continue;
+		}
+
+		t->uri = g_key_file_get_string(kf, "download", "uri", NULL);
+		t->referer = g_key_file_get_string(kf, "download", "referer",
+		                                   NULL);
+		t->etag = g_key_file_get_string(kf, "download", "etag", NULL);
+		t->total = g_key_file_get_int64(kf, "download", "total", NULL);
+		for (i = 0; i < MAXSEGMENTS; i++) {
+			key = g_strdup_printf("segment%d", i);
+			seg = g_key_file_get_string(kf, "download", key, NULL);
+			g_free(key);
+			if (!seg)
+				break;
+			t->seg[i].start = g_ascii_strtoll(seg, &p, 10);
+			t->seg[i].pos = g_ascii_strtoll(p, &p, 10);
+			t->seg[i].end = g_ascii_strtoll(p, NULL, 10);
+			g_free(seg);
+		}
+		t->nseg = i;
+
+		if (t->uri && t->nseg) {
+			fprintf(stderr, "surf: resuming download of %s\n",
+			        t->uri);
+			transferstart(t);
+		} else {
+			transferfree(t);
+		}
+		g_key_file_free(kf);
+		g_free(path);
+		g_free(state);
+	}
+	g_dir_close(dir);
+}
+
+void
+transfersave(Transfer *t)
+{
+	GKeyFile *kf = g_key_file_new();
+	char *data, *key, *seg;
+	int i;
+
+	g_key_file_set_string(kf, "download", "uri", t->uri);
+	if (t->referer)
+		g_key_file_set_string(kf, "download", "referer", t->referer);
+	if (t->etag)
+		g_key_file_set_string(kf, "download", "etag", t->etag);
+	g_key_file_set_int64(kf, "download", "total", t->total);
+	for (i = 0; i < t->nseg; i++) {
+		key = g_strdup_printf("segment%d", i);
+		seg = g_strdup_printf("%ld %ld %ld", (long)t->seg[i].start,
+		                      (long)t->seg[i].pos, (long)t->seg[i].end);
+		g_key_file_set_string(kf, "download", key, seg);
+		g_free(seg);
+		g_free(key);
+	}
+
+	data = g_key_file_to_data(kf, NULL, NULL);
+	g_file_set_contents(t->state, data, -1, NULL);
+	g_free(data);
+	g_key_file_free(kf);
+}
+
+/*
+ * Fetches the unfinished parts of t in parallel, each written at its offset
+ * into the partial file. The state saved next to it lets the download be
+ * resumed after a failure or by the next surf.
+ */
+void
+transferstart(Transfer *t)
+{
+	int i;
+
+	if (ftruncate(t->fd, t->total) < 0) {
+		transferfail(t, strerror(errno), TRUE);
+		return;
+	}
+	t->started = t->saved = g_get_monotonic_time();
+	transfersave(t);
+	t->c->transfers = g_slist_prepend(t->c->transfers, t);
+
+	for (i = 0; i < t->nseg; i++) {
+		if (t->seg[i].pos <= t->seg[i].end
+		    && !segmentfetch(&t->seg[i])) {
+			transferfail(t, "invalid URI", TRUE);
+			return;
+		}
+	}
+	updatetitle(t->c);
+}
+
+/* Aborts the requests of t, keeping what has been written so far. */
+void
+transferstop(Transfer *t)
+{
+	int i;
+
+	t->stopped = TRUE;
+	t->c = NULL;
+	t->active++;
+	for (i = 0; i < t->nseg; i++) {
+		if (t->seg[i].retry)
+			g_source_remove(t->seg[i].retry);
+		if (t->seg[i].msg) {
+			soup_session_cancel_message(webkit_get_default_session(),
+			                            t->seg[i].msg,
+			                            SOUP_STATUS_CANCELLED);
+		}
+	}
+	if (g_file_test(t->state, G_FILE_TEST_EXISTS))
+		transfersave(t);
+	if (!--t->active)
+		transferfree(t);
 }
 
 void
@@ -1450,13 +5641,19 @@ toggle(Client *c, const Arg *arg)
 	WebKitWebSettings *settings;
 	char *name = (char *)arg->v;
 	gboolean value;
-	Arg a = { .b = FALSE };
 
 	settings = webkit_web_view_get_settings(c->view);
 	g_object_get(G_OBJECT(settings), name, &value, NULL);
 	g_object_set(G_OBJECT(settings), name, !value, NULL);
 
-	reload(c, &a);
+	/* these apply to the current document, images load on their own */
+	if (!strcmp(name, "enable-caret-browsing")
+	    || !strcmp(name, "auto-load-images")
+	    || !strcmp(name, "enable-spatial-navigation")
+	    || !strcmp(name, "resizable-text-areas"))
+		updatetitle(c);
+	else
+		refresh(c);
 }
 
 void
@@ -1483,10 +5680,8 @@ togglecookiepolicy(Client *c, const Arg *arg)
 void
 togglegeolocation(Client *c, const Arg *arg)
 {
-	Arg a = { .b = FALSE };
-
 	allowgeolocation ^= 1;
-	reload(c, &a);
+	refresh(c);
 }
 
 void
@@ -1589,7 +5784,11 @@ getpagestat(Client *c)
 void
 updatetitle(Client *c)
 {
-	char *t;
+	char *t, *dl;
+	GSList *d;
+	Transfer *tr;
+	gdouble progress = 0;
+	int i;
 
 	if (showindicators) {
 		gettogglestat(c);
@@ -1607,6 +5806,32 @@ updatetitle(Client *c)
 			                    c->title == NULL ? "" : c->title);
 		}
 
+		if (c->findneedle && *c->findneedle) {
+			dl = g_strdup_printf("[%u/%u] %s", c->findhits->len ?
+			                     c->findcur + 1 : 0,
+			                     c->findhits->len, t);
+			g_free(t);
+			t = dl;
+		}
+
+		if (c->downloads || c->transfers) {
+			for (d = c->downloads; d; d = d->next)
+				progress += webkit_download_get_progress(d->data);
+			for (d = c->transfers; d; d = d->next) {
+				tr = d->data;
+				for (i = 0; i < tr->nseg; i++) {
+					progress += (gdouble)(tr->seg[i].pos
+					            - tr->seg[i].start) / tr->total;
+				}
+			}
+			progress /= g_slist_length(c->downloads)
+			            + g_slist_length(c->transfers);
+			dl = g_strdup_printf("[dl %i%%] %s",
+			                     (int)(progress * 100), t);
+			g_free(t);
+			t = dl;
+		}
+
 		gtk_window_set_title(GTK_WINDOW(c->win), t);
 		g_free(t);
 	} else {
@@ -1625,15 +5850,60 @@ updatewinid(Client *c)
 void
 usage(void)
 {
-	die("usage: %s [-bBdDfFgGiIkKmMnNpPsSvx] [-a cookiepolicies ] "
-	    "[-c cookiefile] [-e xid] [-r scriptfile] [-t stylefile] "
-	    "[-u useragent] [-z zoomlevel] [uri]\n", basename(argv0));
+	die("usage: %s [-bBdDfFgGiIkKlLmMnNpPqQRsSvx] [-a cookiepolicies ] "
+	    "[-A pattern] [-c cookiefile] [-e xid] [-H pattern] "
+	    "[-r scriptfile] [-t stylefile] [-u useragent] [-w manifest] "
+	    "[-z zoomlevel] [uri]\n", basename(argv0));
+}
+
+gboolean
+winevent(GtkWidget *w, GdkEvent *e, Client *c)
+{
+	switch (e->type) {
+	case GDK_MAP:
+		setvisible(c, TRUE);
+		break;
+	case GDK_UNMAP:
+		setvisible(c, FALSE);
+		/* windows only covered by others keep their page */
+		if (suspendtimeout && !c->suspendtimer)
+			c->suspendtimer = g_timeout_add_seconds(suspendtimeout,
+			                                        suspendclient, c);
+		break;
+	case GDK_VISIBILITY_NOTIFY:
+		setvisible(c, e->visibility.state
+		           != GDK_VISIBILITY_FULLY_OBSCURED);
+		break;
+	case GDK_FOCUS_CHANGE:
+		if (e->focus_change.in)
+			c->lastactive = g_get_monotonic_time();
+		else {
+			takesnapshot(c);
+			savesession();
+		}
+		break;
+	default:
+		break;
+	}
+
+	return FALSE;
 }
 
 void
 windowobjectcleared(GtkWidget *w, WebKitWebFrame *frame, JSContextRef js,
                     JSObjectRef win, Client *c)
 {
+	if (!g_slist_find(c->frames, frame)) {
+		c->frames = g_slist_prepend(c->frames, frame);
+		g_object_weak_ref(G_OBJECT(frame), framegone, c);
+	}
+	c->findstale = TRUE;
+	evalscript(js, (char *)findscript, "");
+	if (throttlehidden) {
+		evalscript(js, (char *)throttlescript, "");
+		if (!c->visible)
+			evalscript(js, "__surfthrottle(true);", "");
+	}
 	runscript(frame);
 }
 
@@ -1659,6 +5929,7 @@ main(int argc, char *argv[])
 {
 	Arg arg;
 	Client *c;
+	int failed;
 
 	memset(&arg, 0, sizeof(arg));
 
@@ -1667,6 +5938,11 @@ main(int argc, char *argv[])
 	case 'a':
 		cookiepolicies = EARGF(usage());
 		break;
+	case 'A':
+		cachefolder = buildpath(cachefolder);
+		assetdir = buildpath(assetdir);
+		importassets(EARGF(usage()));
+		return EXIT_SUCCESS;
 	case 'b':
 		enablescrollbars = 0;
 		break;
@@ -1697,6 +5973,14 @@ main(int argc, char *argv[])
 	case 'G':
 		allowgeolocation = 1;
 		break;
+	case 'H':
+		if (!historyfile)
+			return EXIT_FAILURE;
+		historyfile = buildfile(historyfile);
+		historyindex = g_strconcat(historyfile, ".index", NULL);
+		historyprefix = g_strconcat(historyfile, ".prefix", NULL);
+		historyquery(EARGF(usage()));
+		return EXIT_SUCCESS;
 	case 'i':
 		loadimages = 0;
 		break;
@@ -1709,6 +5993,12 @@ main(int argc, char *argv[])
 	case 'K':
 		kioskmode = 1;
 		break;
+	case 'l':
+		enablestats = 0;
+		break;
+	case 'L':
+		enablestats = 1;
+		break;
 	case 'm':
 		enablestyle = 0;
 		break;
@@ -1727,12 +6017,21 @@ main(int argc, char *argv[])
 	case 'P':
 		enableplugins = 1;
 		break;
+	case 'q':
+		enablescheduler = 0;
+		break;
+	case 'Q':
+		enablescheduler = 1;
+		break;
 	case 'r':
 		scriptfile = EARGF(usage());
 		break;
 	case 's':
 		enablescripts = 0;
 		break;
+	case 'R':
+		restoresession = 1;
+		break;
 	case 'S':
 		enablescripts = 1;
 		break;
@@ -1742,6 +6041,9 @@ main(int argc, char *argv[])
 	case 'u':
 		useragent = EARGF(usage());
 		break;
+	case 'w':
+		prewarmfile = EARGF(usage());
+		break;
 	case 'v':
 		die("surf-"VERSION", ©2009-2015 surf engineers, "
 		    "see LICENSE for details\n");
@@ -1758,11 +6060,22 @@ main(int argc, char *argv[])
 		arg.v = argv[0];
 
 	setup();
-	c = newclient();
-	if (arg.v)
-		loaduri(clients, &arg);
-	else
-		updatetitle(c);
+	if (prewarmfile) {
+		failed = prewarm(prewarmfile);
+		cleanup();
+		return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	if (!(sessionfile && loadsession()) || arg.v) {
+		c = newclient();
+		if (kioskmode && playlistmode && LENGTH(playlist))
+			playliststart(c);
+		else if (arg.v)
+			loaduri(clients, &arg);
+		else
+			updatetitle(c);
+	}
+
+	transferresume(clients);
 
 	gtk_main();
 	cleanup();